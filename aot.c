@@ -0,0 +1,342 @@
+// Ahead of time recompiler for chip8.h.
+//
+// Usage: chip8_aot rom.ch8 out.c [name]
+//
+// Follows the control flow of the ROM from 0x200 through
+// jumps, calls and both sides of every skip and writes a
+// C translation unit with one label per instruction it
+// found, so the C compiler sees the whole program at once
+// and keeps V0-VF and I in host registers. The generated
+//
+//     chip8_u8 chip8_run_<name>(struct chip8* vm, const chip8_u8* input, chip8_u32 max_cycles);
+//
+// behaves like chip8_run. It links against chip8.h (which
+// has to be implemented in some other translation unit)
+// and hands the following to the predecoded interpreter:
+//
+// - drawing, RND, key waits and memory transfers, one
+//   instruction at a time
+// - addresses only known at run time (BNNN, RET) that
+//   were not found statically
+// - everything, once the program writes over code that
+//   was compiled, or when breakpoints are set, a trace is
+//   on (see chip8_set_trace) or another ROM is loaded
+//
+// Stores only check the bytes they wrote. The whole ROM is
+// compared against memory again only when the VM or its
+// generation changes, after a breakpoint or trace run, or
+// while compiled code is known to be overwritten. Like
+// chip8_jit_invalidate, the generated
+//
+//     void chip8_invalidate_<name>(struct chip8* vm, chip8_u16 address, chip8_u16 size);
+//
+// has to be told about any other write into memory. The
+// state it keeps is global to the generated file, one VM
+// at a time gets the cached check.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#define CHIP8_IMPLEMENTATION
+#include "chip8.h"
+#include "tools.h"
+
+#define CHIP8__OP_NAME(name, func) #name,
+static const char* const op_names[CHIP8_OP_COUNT] = { "UNDECODED", CHIP8__OPS(CHIP8__OP_NAME) };
+#undef CHIP8__OP_NAME
+
+static struct chip8 vm;
+static chip8_u16 rom_end; // one past the last ROM byte
+static chip8_u8 reached[4096]; // an instruction starts here
+static chip8_u8 code[4096]; // byte belongs to a compiled instruction
+static chip8_u16 worklist[4096];
+static int worklist_size;
+
+// only whole instructions inside the ROM are compiled,
+// anything else is left to the interpreter at run time
+static void visit(chip8_u32 address)
+{
+    if(address < 0x200 || address + 2 > rom_end || reached[address]) return;
+    reached[address] = true;
+    worklist[worklist_size++] = (chip8_u16)address;
+}
+
+static void discover(void)
+{
+    visit(0x200);
+    while(worklist_size > 0)
+    {
+        chip8_u16 pc = worklist[--worklist_size];
+        struct chip8_insn insn;
+        chip8__decode(&vm, pc, &insn);
+        code[pc] = code[pc + 1] = true;
+        switch(insn.op)
+        {
+            case CHIP8_OP_HALT: break;
+            case CHIP8_OP_RET: break;
+            case CHIP8_OP_JP_V0: break;
+            case CHIP8_OP_JP: visit(CHIP8_INSN_NNN(&insn)); break;
+            case CHIP8_OP_CALL: visit(CHIP8_INSN_NNN(&insn)); visit(pc + 2); break;
+            case CHIP8_OP_SE_VX_NN:
+            case CHIP8_OP_SNE_VX_NN:
+            case CHIP8_OP_SE_VX_VY:
+            case CHIP8_OP_SNE_VX_VY:
+            case CHIP8_OP_SKP:
+            case CHIP8_OP_SKNP: visit(pc + 2); visit(pc + 4); break;
+            default: visit(pc + 2); break;
+        }
+    }
+}
+
+// continue at `target`, directly when it was compiled
+static void emit_goto(FILE* out, chip8_u32 target)
+{
+    if(target < 4096 && reached[target]) fprintf(out, "goto L_%03X;", target);
+    else fprintf(out, "{ vm->PC = 0x%03X; goto dispatch; }", target);
+}
+
+// falls through when the next label is `target`
+static void emit_next(FILE* out, chip8_u16 pc, chip8_u32 target)
+{
+    chip8_u32 next = pc + 1;
+    while(next < 4096 && !reached[next]) next++;
+    if(next == target && reached[target]) return;
+    fprintf(out, "    ");
+    emit_goto(out, target);
+    fprintf(out, "\n");
+}
+
+static void emit_skip(FILE* out, chip8_u16 pc, const char* condition)
+{
+    fprintf(out, "    if(%s) ", condition);
+    emit_goto(out, pc + 4);
+    fprintf(out, "\n");
+    emit_next(out, pc, pc + 2);
+}
+
+static void emit_insn(FILE* out, chip8_u16 pc)
+{
+    struct chip8_insn insn;
+    char condition[64];
+    chip8__decode(&vm, pc, &insn);
+    chip8_u8 x = insn.x, y = insn.y;
+    fprintf(out, "L_%03X: // %02X%02X %s\n", pc, vm.memory[pc], vm.memory[pc + 1], op_names[insn.op]);
+    fprintf(out, "    AOT_TICK(0x%03X);\n", pc);
+    switch(insn.op)
+    {
+        case CHIP8_OP_HALT:
+            fprintf(out, "    vm->PC = 0x%03X; result = CHIP8_EXIT_HALT; goto done;\n", pc);
+            return;
+        case CHIP8_OP_RET:
+            fprintf(out, "    if(vm->SP == 0) { vm->PC = 0x%03X; result = CHIP8_EXIT_STACK_UNDERFLOW; goto done; }\n", pc + 2);
+            fprintf(out, "    vm->SP -= 1; vm->PC = vm->stack[vm->SP]; goto dispatch;\n");
+            return;
+        case CHIP8_OP_JP:
+            fprintf(out, "    ");
+            emit_goto(out, CHIP8_INSN_NNN(&insn));
+            fprintf(out, "\n");
+            return;
+        case CHIP8_OP_CALL:
+            fprintf(out, "    if(vm->SP == 16) { vm->PC = 0x%03X; result = CHIP8_EXIT_STACK_OVERFLOW; goto done; }\n", pc + 2);
+            fprintf(out, "    vm->stack[vm->SP] = 0x%03X; vm->SP += 1;\n    ", pc + 2);
+            emit_goto(out, CHIP8_INSN_NNN(&insn));
+            fprintf(out, "\n");
+            return;
+        case CHIP8_OP_JP_V0:
+            fprintf(out, "    vm->PC = (chip8_u16)(V[%d] + 0x%03X); goto dispatch;\n", CHIP8_QUIRK_JUMP_VX ? x : 0, CHIP8_INSN_NNN(&insn));
+            return;
+        case CHIP8_OP_SE_VX_NN: sprintf(condition, "V[%d] == 0x%02X", x, insn.nn); emit_skip(out, pc, condition); return;
+        case CHIP8_OP_SNE_VX_NN: sprintf(condition, "V[%d] != 0x%02X", x, insn.nn); emit_skip(out, pc, condition); return;
+        case CHIP8_OP_SE_VX_VY: sprintf(condition, "V[%d] == V[%d]", x, y); emit_skip(out, pc, condition); return;
+        case CHIP8_OP_SNE_VX_VY: sprintf(condition, "V[%d] != V[%d]", x, y); emit_skip(out, pc, condition); return;
+        case CHIP8_OP_SKP: sprintf(condition, "input[V[%d]]", x); emit_skip(out, pc, condition); return;
+        case CHIP8_OP_SKNP: sprintf(condition, "!input[V[%d]]", x); emit_skip(out, pc, condition); return;
+        case CHIP8_OP_SYS: break;
+        case CHIP8_OP_UNKNOWN: break;
+        case CHIP8_OP_LD_VX_NN: fprintf(out, "    V[%d] = 0x%02X;\n", x, insn.nn); break;
+        case CHIP8_OP_ADD_VX_NN: fprintf(out, "    V[%d] += 0x%02X;\n", x, insn.nn); break;
+        case CHIP8_OP_LD_VX_VY: fprintf(out, "    V[%d] = V[%d];\n", x, y); break;
+        case CHIP8_OP_OR: fprintf(out, "    V[%d] |= V[%d];%s\n", x, y, CHIP8_QUIRK_VF_RESET ? " V[15] = 0;" : ""); break;
+        case CHIP8_OP_AND: fprintf(out, "    V[%d] &= V[%d];%s\n", x, y, CHIP8_QUIRK_VF_RESET ? " V[15] = 0;" : ""); break;
+        case CHIP8_OP_XOR: fprintf(out, "    V[%d] ^= V[%d];%s\n", x, y, CHIP8_QUIRK_VF_RESET ? " V[15] = 0;" : ""); break;
+        // the flag goes last, it wins when x is F
+        case CHIP8_OP_ADD_VX_VY:
+            fprintf(out, "    { chip8_u16 t = (chip8_u16)V[%d] + V[%d]; V[%d] = (chip8_u8)t; V[15] = t > 255; }\n", x, y, x);
+            break;
+        case CHIP8_OP_SUB:
+            fprintf(out, "    { chip8_u8 a = V[%d], b = V[%d]; V[%d] = a - b; V[15] = a >= b; }\n", x, y, x);
+            break;
+        case CHIP8_OP_SUBN:
+            fprintf(out, "    { chip8_u8 a = V[%d], b = V[%d]; V[%d] = a - b; V[15] = a >= b; }\n", y, x, x);
+            break;
+        case CHIP8_OP_SHR:
+            fprintf(out, "    { chip8_u8 t = V[%d]; V[%d] = t >> 1; V[15] = t & 1; }\n", CHIP8_QUIRK_SHIFT_VY ? y : x, x);
+            break;
+        case CHIP8_OP_SHL:
+            fprintf(out, "    { chip8_u8 t = V[%d]; V[%d] = (chip8_u8)(t << 1); V[15] = t >> 7; }\n", CHIP8_QUIRK_SHIFT_VY ? y : x, x);
+            break;
+        case CHIP8_OP_LD_I_NNN: fprintf(out, "    I = 0x%03X;\n", CHIP8_INSN_NNN(&insn)); break;
+        case CHIP8_OP_ADD_I_VX: fprintf(out, "    I += V[%d];\n", x); break;
+        case CHIP8_OP_LD_F_VX: fprintf(out, "    I = (chip8_u16)(V[%d] * 5);\n", x); break;
+        case CHIP8_OP_LD_VX_DT: fprintf(out, "    V[%d] = vm->DT;\n", x); break;
+        case CHIP8_OP_LD_DT_VX: fprintf(out, "    vm->DT = V[%d];\n", x); break;
+        case CHIP8_OP_LD_ST_VX: fprintf(out, "    vm->ST = V[%d];\n", x); break;
+        // stores into memory may hit compiled code
+        case CHIP8_OP_LD_B_VX: fprintf(out, "    vm->PC = 0x%03X; AOT_WRITE(3);\n", pc); break;
+        case CHIP8_OP_LD_MEM_VX: fprintf(out, "    vm->PC = 0x%03X; AOT_WRITE(%d);\n", pc, x + 1); break;
+        default: fprintf(out, "    vm->PC = 0x%03X; AOT_STEP();\n", pc); break;
+    }
+    emit_next(out, pc, pc + 2);
+}
+
+static void emit_bytes(FILE* out, const chip8_u8* bytes, int count)
+{
+    for(int i = 0 ; i < count ; i++) fprintf(out, "%s0x%02X,", (i % 16) ? " " : "\n    ", bytes[i]);
+    fprintf(out, "\n");
+}
+
+static void emit(FILE* out, const char* rom_path, const char* name)
+{
+    fprintf(out, "// Generated by chip8_aot from %s, do not edit.\n//\n", rom_path);
+    fprintf(out, "// chip8_u8 chip8_run_%s(struct chip8* vm, const chip8_u8* input, chip8_u32 max_cycles);\n", name);
+    fprintf(out, "// void chip8_invalidate_%s(struct chip8* vm, chip8_u16 address, chip8_u16 size);\n\n", name);
+    fprintf(out, "#include \"chip8.h\"\n\n");
+
+    // the translation bakes in the quirks chip8_aot was
+    // built with, the interpreter it falls back to has to
+    // agree with them
+    const struct { const char* name; int value; } quirks[] =
+    {
+        { "CHIP8_QUIRK_SHIFT_VY", CHIP8_QUIRK_SHIFT_VY },
+        { "CHIP8_QUIRK_LOAD_STORE_I", CHIP8_QUIRK_LOAD_STORE_I },
+        { "CHIP8_QUIRK_JUMP_VX", CHIP8_QUIRK_JUMP_VX },
+        { "CHIP8_QUIRK_VF_RESET", CHIP8_QUIRK_VF_RESET },
+        { "CHIP8_QUIRK_CLIP", CHIP8_QUIRK_CLIP },
+    };
+    for(size_t i = 0 ; i < sizeof(quirks) / sizeof(quirks[0]) ; i++)
+        fprintf(out, "#if !(%s) != %d\n#error \"%s does not match chip8_aot\"\n#endif\n", quirks[i].name, !quirks[i].value, quirks[i].name);
+    fprintf(out, "\n");
+
+    fprintf(out, "#define AOT_LOAD() do { I = vm->I;");
+    for(int i = 0 ; i < 16 ; i++) fprintf(out, " V[%d] = vm->regs[%d];", i, i);
+    fprintf(out, " } while(0)\n");
+    fprintf(out, "#define AOT_STORE() do { vm->I = I;");
+    for(int i = 0 ; i < 16 ; i++) fprintf(out, " vm->regs[%d] = V[%d];", i, i);
+    fprintf(out, " } while(0)\n");
+    fprintf(out, "#define AOT_TICK(pc) do { if(remaining == 0) { vm->PC = (pc); goto done; } remaining--; } while(0)\n");
+    fprintf(out, "// runs the instruction at vm->PC on the interpreter\n");
+    fprintf(out, "#define AOT_STEP() do { AOT_STORE(); chip8_u8 reason = chip8_run_predecoded(vm, input, 1); AOT_LOAD(); if(reason != CHIP8_EXIT_NONE) { result = reason; goto done; } } while(0)\n");
+    fprintf(out, "#define AOT_WRITE(size) do { chip8_u16 at = I; AOT_STEP(); if(!aot_intact(vm, at, (size))) goto modified; } while(0)\n\n");
+
+    int image_size = rom_end - 0x200;
+    fprintf(out, "static const chip8_u8 aot_image[%d] =\n{", image_size);
+    emit_bytes(out, vm.memory + 0x200, image_size);
+    fprintf(out, "};\n\n");
+
+    chip8_u8 mask[4096 / 8] = {0};
+    for(int i = 0 ; i < 4096 ; i++) if(code[i]) mask[i >> 3] |= (chip8_u8)(1 << (i & 7));
+    fprintf(out, "// one bit per byte of compiled code\nstatic const chip8_u8 aot_code[512] =\n{");
+    emit_bytes(out, mask, 512);
+    fprintf(out, "};\n\n");
+
+    fprintf(out, "// false if a compiled byte in [address, address + size), wrapped\n");
+    fprintf(out, "// around the end of memory like every store, no longer holds the ROM\n");
+    fprintf(out, "static chip8_u8 aot_intact(const struct chip8* vm, chip8_u32 address, chip8_u32 size)\n{\n");
+    fprintf(out, "    for(chip8_u32 k = 0 ; k < size ; k++)\n    {\n");
+    fprintf(out, "        chip8_u32 i = (address + k) & 0xFFF;\n");
+    fprintf(out, "        if(i < 0x200 || i >= 0x%03X || !((aot_code[i >> 3] >> (i & 7)) & 1)) continue;\n", rom_end);
+    fprintf(out, "        if(vm->memory[i] != aot_image[i - 0x200]) return false;\n");
+    fprintf(out, "    }\n    return true;\n}\n\n");
+
+    fprintf(out, "// the VM and generation aot_valid holds for, the ROM is only\n");
+    fprintf(out, "// scanned again when either changes or compiled code was\n");
+    fprintf(out, "// written over, other stores check just what they wrote\n");
+    fprintf(out, "static const struct chip8* aot_vm;\n");
+    fprintf(out, "static chip8_u32 aot_generation;\n");
+    fprintf(out, "static chip8_u8 aot_valid;\n\n");
+
+    fprintf(out, "// to be called after writing into the memory of a VM from outside\n");
+    fprintf(out, "void chip8_invalidate_%s(struct chip8* vm, chip8_u16 address, chip8_u16 size)\n{\n", name);
+    fprintf(out, "    if(vm == aot_vm && !aot_intact(vm, address, size)) aot_valid = false;\n}\n\n");
+
+    fprintf(out, "chip8_u8 chip8_run_%s(struct chip8* vm, const chip8_u8* input, chip8_u32 max_cycles)\n{\n", name);
+    fprintf(out, "    if(vm->breakpoint_count || vm->trace)\n    {\n");
+    fprintf(out, "        aot_vm = 0; // stores are not checked meanwhile\n");
+    fprintf(out, "        return chip8_run_predecoded(vm, input, max_cycles);\n    }\n");
+    fprintf(out, "    if(vm != aot_vm || vm->generation != aot_generation || !aot_valid)\n    {\n");
+    fprintf(out, "        aot_vm = vm;\n");
+    fprintf(out, "        aot_generation = vm->generation;\n");
+    fprintf(out, "        aot_valid = aot_intact(vm, 0x200, 0x%03X);\n", image_size);
+    fprintf(out, "        if(!aot_valid) return chip8_run_predecoded(vm, input, max_cycles);\n    }\n");
+    fprintf(out, "    chip8_u64 start = vm->cycles;\n");
+    fprintf(out, "    chip8_u32 remaining = max_cycles;\n");
+    fprintf(out, "    chip8_u8 result = CHIP8_EXIT_NONE;\n");
+    fprintf(out, "    chip8_u8 V[16];\n");
+    fprintf(out, "    chip8_u16 I;\n");
+    fprintf(out, "    AOT_LOAD();\n\n");
+    fprintf(out, "dispatch:\n");
+    fprintf(out, "    if(vm->PC >= 4096) { result = CHIP8_EXIT_PC_OUT_OF_RANGE; goto done; }\n");
+    fprintf(out, "    switch(vm->PC)\n    {\n");
+    for(int i = 0 ; i < 4096 ; i++) if(reached[i]) fprintf(out, "        case 0x%03X: goto L_%03X;\n", i, i);
+    fprintf(out, "        default: break;\n    }\n");
+    fprintf(out, "    // not found statically, this may also be a store\n");
+    fprintf(out, "    AOT_TICK(vm->PC);\n");
+    fprintf(out, "    AOT_WRITE(16);\n");
+    fprintf(out, "    goto dispatch;\n\n");
+    for(int i = 0 ; i < 4096 ; i++) if(reached[i]) emit_insn(out, (chip8_u16)i);
+    fprintf(out, "\nmodified:\n");
+    fprintf(out, "    // the program wrote over compiled code, interpret the rest\n");
+    fprintf(out, "    aot_valid = false;\n");
+    fprintf(out, "    vm->cycles = start + (max_cycles - remaining);\n");
+    fprintf(out, "    return chip8_run_predecoded(vm, input, remaining);\n\n");
+    fprintf(out, "done:\n");
+    fprintf(out, "    AOT_STORE();\n");
+    fprintf(out, "    vm->cycles = start + (max_cycles - remaining);\n");
+    fprintf(out, "    return result;\n}\n");
+}
+
+// the file name without directories and extension, made
+// into a C identifier
+static void default_name(const char* path, char* name, size_t size)
+{
+    const char* base = path;
+    for(const char* c = path ; *c ; c++) if(*c == '/' || *c == '\\') base = c + 1;
+    size_t length = 0;
+    for(const char* c = base ; *c && *c != '.' && length + 1 < size ; c++) name[length++] = isalnum((unsigned char)*c) ? *c : '_';
+    name[length] = '\0';
+    if(length == 0) snprintf(name, size, "rom");
+}
+
+int main(int argc, char** argv)
+{
+    if(argc < 3)
+    {
+        printf("Usage: chip8_aot rom.ch8 out.c [name]\n");
+        return EXIT_FAILURE;
+    }
+
+    chip8_u16 size = 0;
+    chip8_u8* data = read_file(argv[1], &size);
+    chip8_init(&vm);
+    if(data == NULL || !chip8_load_rom(&vm, data, size)) { printf("Unable to load ROM %s\n", argv[1]); return EXIT_FAILURE; }
+    rom_end = (chip8_u16)(0x200 + size);
+
+    char name[64];
+    if(argc >= 4) snprintf(name, sizeof(name), "%s", argv[3]);
+    else default_name(argv[1], name, sizeof(name));
+
+    discover();
+
+    FILE* out = fopen(argv[2], "w");
+    if(out == NULL) { printf("Unable to write %s\n", argv[2]); free(data); return EXIT_FAILURE; }
+    emit(out, argv[1], name);
+    fclose(out);
+
+    int count = 0;
+    for(int i = 0 ; i < 4096 ; i++) count += reached[i];
+    printf("chip8_run_%s: %d instructions compiled\n", name, count);
+    free(data);
+    return EXIT_SUCCESS;
+}
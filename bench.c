@@ -0,0 +1,290 @@
+// Throughput benchmark for the chip8.h interpreter cores.
+//
+// Usage: chip8_bench [-n instructions] [-s seed] [-i script] [-j] [rom...]
+//
+// Runs every ROM of the corpus (or a small built in
+// sprite/ALU loop when none is given) for a fixed number
+// of instructions on every core, checks that all of them
+// end up in exactly the same state and reports how fast
+// each one was. RND is seeded the same way for every run
+// and the script (the `frame key down` lines of
+// chip8_headless, a frame being one timer period here)
+// plays the same input back each time, so the numbers can
+// be compared from one build to the next. -j prints JSON
+// instead of a table.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define CHIP8_JIT
+#endif
+
+#define CHIP8_IMPLEMENTATION
+#define CHIP8_TOOLS_CORES
+#include "chip8.h"
+#include "tools.h"
+
+#define BENCH_SEED 1234
+#define BENCH_TIMER_PERIOD 1000 // instructions per 60 Hz timer tick
+#define BENCH_MAX_EVENTS 4096
+#define BENCH_MAX_ROMS 256
+
+static const chip8_u8 demo_rom[] =
+{
+    0x60, 0x00, // 200: LD V0, 0
+    0x61, 0x00, // 202: LD V1, 0
+    0x62, 0x05, // 204: LD V2, 5
+    0xF2, 0x29, // 206: LD F, V2
+    0xD0, 0x15, // 208: DRW V0, V1, 5
+    0x70, 0x03, // 20A: ADD V0, 3
+    0x81, 0x24, // 20C: ADD V1, V2
+    0x83, 0x03, // 20E: XOR V3, V0
+    0x84, 0x15, // 210: SUB V4, V1
+    0xC5, 0x0F, // 212: RND V5, 0F
+    0x72, 0x01, // 214: ADD V2, 1
+    0x42, 0x10, // 216: SNE V2, 10
+    0x62, 0x00, // 218: LD V2, 0
+    0x30, 0x3F, // 21A: SE V0, 3F
+    0x12, 0x06, // 21C: JP 206
+    0x00, 0xE0, // 21E: CLS
+    0x12, 0x00, // 220: JP 200
+};
+
+static struct script_event events[BENCH_MAX_EVENTS];
+static size_t event_count;
+
+// what the untimed profiling run of a ROM saw
+static struct
+{
+    unsigned long long executed;
+    unsigned long long draws;
+    chip8_u8 seen[4096 / 8]; // one bit per instruction address that ran
+} profile;
+
+// Steps the switch core one instruction at a time and
+// counts what runs. Polling loops the cores fast-forward
+// are stepped through here, so they count at full weight.
+static chip8_u8 run_profile(struct chip8* vm, const chip8_u8* input, chip8_u32 max_cycles)
+{
+    chip8_u64 end = vm->cycles + max_cycles;
+    while(vm->cycles < end)
+    {
+        chip8_u16 pc = vm->PC & 4095;
+        profile.seen[pc >> 3] |= (chip8_u8)(1 << (pc & 7));
+        profile.draws += (vm->memory[pc] >> 4) == 0xD;
+        profile.executed++;
+        chip8_u8 reason = chip8_run_switch(vm, input, 1);
+        if(reason != CHIP8_EXIT_NONE) return reason;
+    }
+    return CHIP8_EXIT_NONE;
+}
+
+// Runs exactly `count` instructions, restarting the ROM
+// whenever it exits, and returns the seconds it took. A
+// key wait idles until the next timer tick, as nothing
+// can change before the scripted input does. The cycles
+// spent that way or skipped over idle loops (see
+// vm->idle_cycles) are stored in `idled`, they were
+// counted but not executed.
+static double bench_run(const struct bench_core* core, struct chip8* vm, const chip8_u8* rom, chip8_u16 rom_size, unsigned long long count, chip8_u64 seed, unsigned long long* idled)
+{
+    chip8_u8 input[16] = {0};
+    chip8_seed(vm, seed);
+    chip8_load_rom(vm, rom, rom_size);
+    clock_t start = clock();
+    chip8_u32 until_tick = BENCH_TIMER_PERIOD;
+    unsigned long long tick = 0;
+    size_t next_event = 0;
+    *idled = 0;
+    while(count > 0)
+    {
+        for( ; next_event < event_count && events[next_event].frame <= tick ; next_event++)
+            input[events[next_event].key] = events[next_event].pressed;
+        chip8_u32 batch = count < until_tick ? (chip8_u32)count : until_tick;
+        chip8_u64 before = vm->cycles;
+        chip8_u64 idle_before = vm->idle_cycles;
+        chip8_u8 reason = core->run(vm, input, batch);
+        *idled += vm->idle_cycles - idle_before;
+        if(reason == CHIP8_EXIT_KEY_WAIT)
+        {
+            *idled += before + batch - vm->cycles;
+            vm->cycles = before + batch;
+        }
+        chip8_u32 done = (chip8_u32)(vm->cycles - before);
+        count -= done;
+        until_tick -= done;
+        if(until_tick == 0)
+        {
+            chip8_update_timer(vm);
+            until_tick = BENCH_TIMER_PERIOD;
+            tick++;
+        }
+        if(CHIP8_EXIT_IS_FATAL(reason)) chip8_load_rom(vm, rom, rom_size);
+    }
+    return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+static chip8_u8 same_state(const struct chip8* a, const struct chip8* b)
+{
+    return memcmp(a->memory, b->memory, sizeof(a->memory)) == 0
+        && memcmp(a->display, b->display, sizeof(a->display)) == 0
+        && memcmp(a->stack, b->stack, sizeof(a->stack)) == 0
+        && memcmp(a->regs, b->regs, sizeof(a->regs)) == 0
+        && a->I == b->I && a->PC == b->PC && a->SP == b->SP
+        && a->DT == b->DT && a->ST == b->ST;
+}
+
+// Bytes of dispatch data a core reads for the instructions
+// that ran, a rough measure of its cache pressure: raw
+// opcodes for the switch core, predecoded slots for the
+// table driven cores and host code for the JIT.
+static unsigned long long core_footprint(const struct bench_core* core, unsigned long long instructions)
+{
+#ifdef CHIP8_JIT
+    if(core->run == run_jit) return jit->code_used;
+#endif
+    if(core->run == chip8_run_switch) return instructions * 2;
+    return instructions * sizeof(struct chip8_insn);
+}
+
+static void print_json_string(const char* text)
+{
+    putchar('"');
+    for( ; *text ; text++)
+    {
+        unsigned char c = (unsigned char)*text;
+        if(c < 0x20) { printf("\\u%04X", c); continue; }
+        if(c == '"' || c == '\\') putchar('\\');
+        putchar(c);
+    }
+    putchar('"');
+}
+
+static void usage(void)
+{
+    printf("Usage: chip8_bench [-n instructions] [-s seed] [-i script] [-j] [rom...]\n");
+}
+
+int main(int argc, char** argv)
+{
+    unsigned long long count = 50000000ULL;
+    chip8_u64 seed = BENCH_SEED;
+    int json = false;
+    int rom_count = 0;
+    const char* roms[BENCH_MAX_ROMS];
+
+    for(int i = 1 ; i < argc ; i++)
+    {
+        if(strcmp(argv[i], "-j") == 0)
+        {
+            json = true;
+            continue;
+        }
+        if(argv[i][0] == '-' && argv[i][1] != '\0' && argv[i][2] == '\0' && i + 1 < argc)
+        {
+            const char* value = argv[++i];
+            switch(argv[i - 1][1])
+            {
+                case 'n': count = strtoull(value, NULL, 10); continue;
+                case 's': seed = strtoull(value, NULL, 0); continue;
+                case 'i':
+                    if(read_script(value, events, BENCH_MAX_EVENTS, &event_count)) continue;
+                    return EXIT_FAILURE;
+            }
+        }
+        else if(argv[i][0] != '-' && rom_count < BENCH_MAX_ROMS)
+        {
+            roms[rom_count++] = argv[i];
+            continue;
+        }
+        usage();
+        return EXIT_FAILURE;
+    }
+    if(count == 0) { usage(); return EXIT_FAILURE; }
+
+    static struct chip8 reference, vm;
+    static const struct bench_core profiler = { "profile", run_profile };
+    int status = EXIT_SUCCESS;
+    int reported = 0;
+
+    if(json) printf("{\n  \"instructions\": %llu,\n  \"seed\": %llu,\n  \"timer_period\": %d,\n  \"roms\": [", count, (unsigned long long)seed, BENCH_TIMER_PERIOD);
+    for(int r = 0 ; r < (rom_count ? rom_count : 1) ; r++)
+    {
+        const char* name = rom_count ? roms[r] : "demo";
+        const chip8_u8* rom = demo_rom;
+        chip8_u16 rom_size = sizeof(demo_rom);
+        chip8_u8* data = NULL;
+        if(rom_count)
+        {
+            data = read_file(name, &rom_size);
+            if(data == NULL) { fprintf(stderr, "Unable to load ROM %s\n", name); status = EXIT_FAILURE; continue; }
+            rom = data;
+        }
+
+        memset(&profile, 0, sizeof(profile));
+        chip8_init(&reference);
+        unsigned long long idled;
+        bench_run(&profiler, &reference, rom, rom_size, count, seed, &idled);
+        unsigned long long distinct = 0;
+        for(size_t i = 0 ; i < sizeof(profile.seen) ; i++)
+            for(chip8_u8 bits = profile.seen[i] ; bits ; bits &= bits - 1) distinct++;
+        double draw_share = profile.executed ? (double)profile.draws / profile.executed : 0.0;
+
+        if(json)
+        {
+            printf("%s\n    {\n      \"rom\": ", reported ? "," : "");
+            print_json_string(name);
+            printf(",\n      \"drw_share\": %.6f,\n      \"distinct_instructions\": %llu,\n      \"cores\": [", draw_share, distinct);
+        }
+        else
+        {
+            printf("%s%s: DRW %.2f%% of instructions, %llu distinct instructions\n", reported ? "\n" : "", name, draw_share * 100.0, distinct);
+            printf("%-12s %10s %10s %8s %10s %7s\n", "core", "MIPS", "ns/insn", "speedup", "footprint", "idle");
+        }
+        reported++;
+
+        double baseline = 0.0;
+        for(size_t i = 0 ; i < CORE_COUNT ; i++)
+        {
+#ifdef CHIP8_JIT
+            // a fresh code cache, so every ROM starts cold
+            if(cores[i].run == run_jit && (jit = chip8_jit_create()) == NULL)
+            {
+                fprintf(stderr, "Unable to allocate the JIT code cache\n");
+                return EXIT_FAILURE;
+            }
+#endif
+            struct chip8* target = i == 0 ? &reference : &vm;
+            chip8_init(target);
+            double seconds = bench_run(&cores[i], target, rom, rom_size, count, seed, &idled);
+            // MIPS and ns/insn only cover what was executed
+            unsigned long long executed = count - idled;
+            if(seconds <= 0.0) seconds = 1.0 / CLOCKS_PER_SEC;
+            if(i == 0) baseline = seconds;
+            chip8_u8 match = i == 0 || same_state(&reference, &vm);
+            if(!match) status = EXIT_FAILURE;
+            unsigned long long footprint = core_footprint(&cores[i], distinct);
+#ifdef CHIP8_JIT
+            if(cores[i].run == run_jit) chip8_jit_destroy(jit);
+#endif
+            if(json)
+            {
+                printf("%s\n        { \"core\": \"%s\", \"seconds\": %.6f, \"executed\": %llu, \"idled\": %llu, \"ips\": %.0f, \"ns_per_insn\": %.4f, \"speedup\": %.4f, \"footprint_bytes\": %llu, \"match\": %s }",
+                    i ? "," : "", cores[i].name, seconds, executed, idled, executed / seconds, executed ? seconds * 1e9 / executed : 0.0, baseline / seconds, footprint, match ? "true" : "false");
+            }
+            else
+            {
+                printf("%-12s %10.2f %10.2f %7.2fx %9lluB %6.2f%%", cores[i].name, executed / seconds / 1e6, executed ? seconds * 1e9 / executed : 0.0, baseline / seconds, footprint, idled * 100.0 / count);
+                if(!match) printf("  MISMATCH");
+                printf("\n");
+            }
+        }
+        if(json) printf("\n      ]\n    }");
+        free(data);
+    }
+    if(json) printf("\n  ]\n}\n");
+    return status;
+}
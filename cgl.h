@@ -266,6 +266,11 @@ typedef void (*CGL_thread_function)(void*);
 struct CGL_mutex;
 typedef struct CGL_mutex CGL_mutex;
 
+struct CGL_signal;
+typedef struct CGL_signal CGL_signal;
+
+#define CGL_SIGNAL_INFINITE UINT64_MAX
+
 CGL_thread* CGL_thread_create();
 bool CGL_thread_start(CGL_thread* thread, CGL_thread_function function, void* argument);
 void CGL_thread_destroy(CGL_thread* thread);
@@ -279,6 +284,11 @@ CGL_mutex* CGL_mutex_create(bool set);
 void CGL_mutex_destroy(CGL_mutex* mutex);
 int CGL_mutex_lock(CGL_mutex* mutex, uint64_t timeout);
 void CGL_mutex_release(CGL_mutex* mutex);
+
+CGL_signal* CGL_signal_create(); // auto reset, a notify wakes one wait or the next one
+void CGL_signal_destroy(CGL_signal* signal);
+void CGL_signal_notify(CGL_signal* signal);
+bool CGL_signal_wait(CGL_signal* signal, uint64_t timeout); // milliseconds, false on timeout
 #endif
 
 // math
@@ -772,6 +782,8 @@ void CGL_shader_compute_dispatch(CGL_shader* shader, int x, int y, int z); // di
 
 // ssbo
 CGL_ssbo* CGL_ssbo_create(uint32_t binding); // create ssbo
+CGL_ssbo* CGL_ssbo_create_streaming(uint32_t binding, size_t capacity, uint32_t regions); // create persistent mapped ssbo ring buffered over `regions` copies
+void CGL_ssbo_stream_advance(CGL_ssbo* ssbo); // call after the draws reading a streaming ssbo, moves writes to the next region
 void CGL_ssbo_destroy(CGL_ssbo* ssbo); // destroy ssbo
 void CGL_ssbo_bind(CGL_ssbo* ssbo); // bind ssbo
 void CGL_ssbo_set_data(CGL_ssbo* ssbo, size_t size, void* data, bool static_draw); // set ssbo data
@@ -914,7 +926,15 @@ typedef struct CGL_tilemap CGL_tilemap;
 struct CGL_tile;
 typedef struct CGL_tile CGL_tile;
 
+struct CGL_tile_packed;
+typedef struct CGL_tile_packed CGL_tile_packed;
+
+#define CGL_TILEMAP_FORMAT_VEC4   0 // 16 bytes per tile
+#define CGL_TILEMAP_FORMAT_PACKED 1 // 8 bytes per tile, RGBA8 colors and 15/16 bit tileset coordinates
+#define CGL_TILEMAP_STREAMING     2 // or'ed with the format, keeps tile data in a persistent mapped ring buffer
+
 CGL_tilemap* CGL_tilemap_create(uint32_t tile_count_x, uint32_t tile_count_y, uint32_t tile_size_x, uint32_t tile_size_y, uint32_t ssbo_binding);
+CGL_tilemap* CGL_tilemap_create_ex(uint32_t tile_count_x, uint32_t tile_count_y, uint32_t tile_size_x, uint32_t tile_size_y, uint32_t ssbo_binding, uint32_t flags); // flags is a CGL_TILEMAP_FORMAT_* optionally or'ed with CGL_TILEMAP_STREAMING
 void CGL_tilemap_destroy(CGL_tilemap* tilemap);
 void CGL_tilemap_set_auto_upload(CGL_tilemap* tilemap, bool value);
 bool CGL_tilemap_get_auto_upload(CGL_tilemap* tilemap);
@@ -1308,6 +1328,35 @@ void CGL_mutex_release(CGL_mutex* mutex)
     ReleaseMutex(mutex->handle);
 }
 
+struct CGL_signal
+{
+    HANDLE handle;
+};
+
+CGL_signal* CGL_signal_create()
+{
+    CGL_signal* signal = (CGL_signal*)malloc(sizeof(CGL_signal));
+    signal->handle = CreateEvent(NULL, FALSE, FALSE, NULL);
+    return signal;
+}
+
+void CGL_signal_destroy(CGL_signal* signal)
+{
+    if(signal->handle) CloseHandle(signal->handle);
+    CGL_free(signal);
+}
+
+void CGL_signal_notify(CGL_signal* signal)
+{
+    SetEvent(signal->handle);
+}
+
+bool CGL_signal_wait(CGL_signal* signal, uint64_t timeout)
+{
+    DWORD milliseconds = timeout >= INFINITE ? INFINITE : (DWORD)timeout;
+    return WaitForSingleObject(signal->handle, milliseconds) == WAIT_OBJECT_0;
+}
+
 #else // for posix (using pthread)
 
 #include <pthread.h>
@@ -1340,7 +1389,7 @@ bool CGL_thread_start(CGL_thread* thread, CGL_thread_function function, void* ar
 {
     if(thread->running) CGL_thread_join(thread);
     thread->function = function;
-    bool success = pthread_create(&thread->handle, 0, (void*)function, argument);
+    bool success = pthread_create(&thread->handle, 0, (void*)function, argument) == 0;
     thread->id = (uintptr_t)thread->handle; // Temporary
     thread->running = true;
     return success;
@@ -1372,7 +1421,8 @@ bool CGL_thread_is_running(CGL_thread* thread)
 bool CGL_thread_join(CGL_thread* thread)
 {
     if(!thread->handle) return true;
-    return pthread_join(thread->handle, NULL);
+    thread->running = false;
+    return pthread_join(thread->handle, NULL) == 0;
 }
 
 bool CGL_thread_joinable(CGL_thread* thread)
@@ -1404,6 +1454,60 @@ void CGL_mutex_release(CGL_mutex* mutex)
     pthread_mutex_unlock(&mutex->handle);  
 }
 
+struct CGL_signal
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t condition;
+    bool set;
+};
+
+CGL_signal* CGL_signal_create()
+{
+    CGL_signal* signal = (CGL_signal*)malloc(sizeof(CGL_signal));
+    pthread_mutex_init(&signal->mutex, NULL);
+    pthread_cond_init(&signal->condition, NULL);
+    signal->set = false;
+    return signal;
+}
+
+void CGL_signal_destroy(CGL_signal* signal)
+{
+    pthread_cond_destroy(&signal->condition);
+    pthread_mutex_destroy(&signal->mutex);
+    CGL_free(signal);
+}
+
+void CGL_signal_notify(CGL_signal* signal)
+{
+    pthread_mutex_lock(&signal->mutex);
+    signal->set = true;
+    pthread_cond_signal(&signal->condition);
+    pthread_mutex_unlock(&signal->mutex);
+}
+
+bool CGL_signal_wait(CGL_signal* signal, uint64_t timeout)
+{
+    struct timespec deadline;
+    if(timeout != CGL_SIGNAL_INFINITE)
+    {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += timeout / 1000;
+        deadline.tv_nsec += (timeout % 1000) * 1000000;
+        if(deadline.tv_nsec >= 1000000000) { deadline.tv_sec++; deadline.tv_nsec -= 1000000000; }
+    }
+    pthread_mutex_lock(&signal->mutex);
+    int result = 0;
+    while(!signal->set && result == 0)
+    {
+        if(timeout == CGL_SIGNAL_INFINITE) result = pthread_cond_wait(&signal->condition, &signal->mutex);
+        else result = pthread_cond_timedwait(&signal->condition, &signal->mutex, &deadline);
+    }
+    bool was_set = signal->set;
+    signal->set = false;
+    pthread_mutex_unlock(&signal->mutex);
+    return was_set;
+}
+
 
 #endif
 
@@ -3435,12 +3539,24 @@ CGL_texture* CGL_framebuffer_get_depth_texture(CGL_framebuffer* framebuffer)
 }
 
 // ssbo
+#define CGL_SSBO_MAX_REGIONS 4
+
 struct CGL_ssbo
 {
     GLuint handle;
     size_t size;
     int binding;
     void* user_data;
+    // streaming mode, mapped is NULL for regular ssbos
+    uint8_t* mapped;
+    uint8_t* shadow; // latest contents, used to bring a region up to date
+    size_t capacity;
+    size_t region_size; // capacity rounded up to the binding offset alignment
+    uint32_t region_count;
+    uint32_t region;
+    GLsync fences[CGL_SSBO_MAX_REGIONS];
+    size_t stale_start[CGL_SSBO_MAX_REGIONS]; // bytes written since the region was last current
+    size_t stale_end[CGL_SSBO_MAX_REGIONS];
 };
 
 // create ssbo
@@ -3456,12 +3572,115 @@ CGL_ssbo* CGL_ssbo_create(uint32_t binding)
     ssbo->binding = binding;
     ssbo->user_data = NULL;
     ssbo->size = 0;
+    ssbo->mapped = NULL;
+    ssbo->shadow = NULL;
+    return ssbo;
+}
+
+// create streaming ssbo
+// the storage is allocated once and stays mapped, every region is a
+// full copy of the data so the CPU writes one while the GPU still
+// reads the others, fences only block if the GPU is `regions` frames behind
+CGL_ssbo* CGL_ssbo_create_streaming(uint32_t binding, size_t capacity, uint32_t regions)
+{
+    if(regions < 1 || regions > CGL_SSBO_MAX_REGIONS || capacity == 0)
+    {
+        CGL_LOG("CGL_ssbo_create_streaming: invalid capacity or region count\n");
+        return NULL;
+    }
+    CGL_ssbo* ssbo = (CGL_ssbo*)malloc(sizeof(CGL_ssbo));
+    if(ssbo == NULL)
+        return NULL;
+    GLint alignment = 256;
+    glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &alignment);
+    if(alignment < 1) alignment = 1;
+    ssbo->capacity = capacity;
+    ssbo->region_size = (capacity + alignment - 1) / alignment * alignment;
+    ssbo->region_count = regions;
+    ssbo->region = 0;
+    ssbo->shadow = (uint8_t*)calloc(capacity, 1);
+    if(ssbo->shadow == NULL)
+    {
+        free(ssbo);
+        return NULL;
+    }
+    GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glGenBuffers(1, &ssbo->handle);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo->handle);
+    glBufferStorage(GL_SHADER_STORAGE_BUFFER, ssbo->region_size * regions, NULL, flags);
+    ssbo->mapped = (uint8_t*)glMapBufferRange(GL_SHADER_STORAGE_BUFFER, 0, ssbo->region_size * regions, flags);
+    glBindBufferRange(GL_SHADER_STORAGE_BUFFER, binding, ssbo->handle, 0, ssbo->region_size);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    if(ssbo->mapped == NULL)
+    {
+        CGL_LOG("CGL_ssbo_create_streaming: unable to map buffer storage\n");
+        glDeleteBuffers(1, &ssbo->handle);
+        free(ssbo->shadow);
+        free(ssbo);
+        return NULL;
+    }
+    memset(ssbo->mapped, 0, ssbo->region_size * regions);
+    for(uint32_t i = 0 ; i < CGL_SSBO_MAX_REGIONS ; i++)
+    {
+        ssbo->fences[i] = NULL;
+        ssbo->stale_start[i] = capacity;
+        ssbo->stale_end[i] = 0;
+    }
+    ssbo->binding = binding;
+    ssbo->user_data = NULL;
+    ssbo->size = 0;
     return ssbo;
 }
 
+// writes into the current region and marks the bytes stale in the others
+static void __CGL_ssbo_stream_write(CGL_ssbo* ssbo, size_t offset, size_t size, void* data)
+{
+    memcpy(ssbo->shadow + offset, data, size);
+    memcpy(ssbo->mapped + ssbo->region * ssbo->region_size + offset, data, size);
+    for(uint32_t i = 0 ; i < ssbo->region_count ; i++)
+    {
+        if(i == ssbo->region) continue;
+        if(offset < ssbo->stale_start[i]) ssbo->stale_start[i] = offset;
+        if(offset + size > ssbo->stale_end[i]) ssbo->stale_end[i] = offset + size;
+    }
+}
+
+// advance streaming ssbo
+void CGL_ssbo_stream_advance(CGL_ssbo* ssbo)
+{
+    if(ssbo->mapped == NULL)
+        return;
+    ssbo->fences[ssbo->region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    ssbo->region = (ssbo->region + 1) % ssbo->region_count;
+    uint32_t region = ssbo->region;
+    if(ssbo->fences[region])
+    {
+        GLenum status = glClientWaitSync(ssbo->fences[region], GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+        while(status == GL_TIMEOUT_EXPIRED)
+            status = glClientWaitSync(ssbo->fences[region], 0, 1000000);
+        glDeleteSync(ssbo->fences[region]);
+        ssbo->fences[region] = NULL;
+    }
+    if(ssbo->stale_start[region] < ssbo->stale_end[region])
+    {
+        size_t start = ssbo->stale_start[region];
+        memcpy(ssbo->mapped + region * ssbo->region_size + start, ssbo->shadow + start, ssbo->stale_end[region] - start);
+        ssbo->stale_start[region] = ssbo->capacity;
+        ssbo->stale_end[region] = 0;
+    }
+    glBindBufferRange(GL_SHADER_STORAGE_BUFFER, ssbo->binding, ssbo->handle, region * ssbo->region_size, ssbo->region_size);
+}
+
 // destroy ssbo
 void CGL_ssbo_destroy(CGL_ssbo* ssbo)
 {
+    if(ssbo->mapped)
+    {
+        for(uint32_t i = 0 ; i < ssbo->region_count ; i++)
+            if(ssbo->fences[i]) glDeleteSync(ssbo->fences[i]);
+        glUnmapNamedBuffer(ssbo->handle);
+        free(ssbo->shadow);
+    }
     glDeleteBuffers(1, &ssbo->handle);
     free(ssbo);
 }
@@ -3475,6 +3694,17 @@ void CGL_ssbo_bind(CGL_ssbo* ssbo)
 // set ssbo data
 void CGL_ssbo_set_data(CGL_ssbo* ssbo, size_t size, void* data, bool static_draw)
 {
+    if(ssbo->mapped)
+    {
+        if(size > ssbo->capacity)
+        {
+            CGL_LOG("CGL_ssbo_set_data: size > ssbo->capacity of streaming ssbo");
+            return;
+        }
+        if(data) __CGL_ssbo_stream_write(ssbo, 0, size, data);
+        ssbo->size = size;
+        return;
+    }
     glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo->handle);
     glBufferData(GL_SHADER_STORAGE_BUFFER, size, data, static_draw ? GL_STATIC_DRAW : GL_DYNAMIC_DRAW);
     glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
@@ -3489,6 +3719,11 @@ void CGL_ssbo_set_sub_data(CGL_ssbo* ssbo, size_t offset, size_t size, void* dat
         CGL_LOG("CGL_ssbo_set_sub_data: offset + size > ssbo->size");
         return;
     }
+    if(ssbo->mapped)
+    {
+        __CGL_ssbo_stream_write(ssbo, offset, size, data);
+        return;
+    }
     glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo->handle);
     glBufferSubData(GL_SHADER_STORAGE_BUFFER, offset, size, data);
     glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
@@ -3499,6 +3734,11 @@ void CGL_ssbo_get_data(CGL_ssbo* ssbo, size_t* size, void* data)
 {
     if(size)
         *size = ssbo->size;
+    if(ssbo->mapped)
+    {
+        memcpy(data, ssbo->shadow, ssbo->size);
+        return;
+    }
     glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo->handle);
     glGetNamedBufferSubData(ssbo->handle, 0, ssbo->size, data);
     glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
@@ -3512,6 +3752,11 @@ void CGL_ssbo_get_sub_data(CGL_ssbo* ssbo, size_t offset, size_t size, void* dat
         CGL_LOG("CGL_ssbo_get_sub_data: offset + size > ssbo->size");
         return;
     }
+    if(ssbo->mapped)
+    {
+        memcpy(data, ssbo->shadow + offset, size);
+        return;
+    }
     glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo->handle);
     glGetNamedBufferSubData(ssbo->handle, offset, size, data);
     glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
@@ -3548,6 +3793,12 @@ void CGL_ssbo_copy(CGL_ssbo* dst, CGL_ssbo* src, size_t src_offset, size_t dst_o
         CGL_LOG("CGL_ssbo_copy: src_offset + size > src->size");
         return;
     }
+    if(dst->mapped)
+    {
+        CGL_LOG("CGL_ssbo_copy: streaming ssbos can only be written from the CPU");
+        return;
+    }
+    if(src->mapped) src_offset += src->region * src->region_size;
     glBindBuffer(GL_SHADER_STORAGE_BUFFER, dst->handle);
     glCopyNamedBufferSubData(src->handle, dst->handle, src_offset, dst_offset, size);
     glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
@@ -5279,6 +5530,7 @@ static const char* __CGL_TILEMAP_VERTEX_SHADER = "#version 430 core\n"
 "}";
 
 static const char* __CGL_TILEMAP_FRAGENT_SHADER = "#version 430 core\n"
+"%s"
 "\n"
 "out vec4 FragColor;\n"
 "//out int MousePick0;\n"
@@ -5298,6 +5550,23 @@ static const char* __CGL_TILEMAP_FRAGENT_SHADER = "#version 430 core\n"
 "uniform sampler2D u_texture_tileset;\n"
 "uniform sampler2DArray u_texture_array;\n"
 "\n"
+"#ifdef CGL_TILEMAP_PACKED\n"
+"layout (std430, binding = %d)  buffer tiles_buffer\n"
+"{\n"
+"    uvec2 tiles[];\n"
+"};\n"
+"\n"
+"// unpacks a CGL_tile_packed into the CGL_tile encoding\n"
+"vec4 cglTileColor(int index)\n"
+"{\n"
+"    uvec2 tile = tiles[index];\n"
+"    uint mode = tile.y >> 30;\n"
+"    if(mode == 1u) return vec4(unpackUnorm4x8(tile.x).xyz, 2.5f);\n"
+"    if(mode == 2u) return vec4(float(tile.x), 0.0f, 0.0f, 1.5f);\n"
+"    if(mode == 3u) return vec4(unpackUnorm2x16(tile.x), float((tile.y >> 15) & 0x7FFFu) / 32767.0f, float(tile.y & 0x7FFFu) / 32767.0f);\n"
+"    return vec4(0.0f, 0.0f, 0.0f, 3.5f);\n"
+"}\n"
+"#else\n"
 "struct cglTile\n"
 "{\n"
 "    vec4 color;\n"
@@ -5308,6 +5577,12 @@ static const char* __CGL_TILEMAP_FRAGENT_SHADER = "#version 430 core\n"
 "    cglTile tiles[];\n"
 "};\n"
 "\n"
+"vec4 cglTileColor(int index)\n"
+"{\n"
+"    return tiles[index].color;\n"
+"}\n"
+"#endif\n"
+"\n"
 "void main()\n"
 "{\n"
 "    vec4 color = vec4(0.0f, 1.0f, 0.0f, 1.0f);\n"
@@ -5337,7 +5612,8 @@ static const char* __CGL_TILEMAP_FRAGENT_SHADER = "#version 430 core\n"
 "        return;\n"
 "    }\n"
 "\n"
-"    cglTile current_tile = tiles[tile_index.y * int(u_tile_count.x) + tile_index.x];\n"
+"    cglTile current_tile;\n"
+"    current_tile.color = cglTileColor(tile_index.y * int(u_tile_count.x) + tile_index.x);\n"
 "\n"
 "    if (current_tile.color.w > 3.0f)  // case where tile is empty\n"
 "    {\n"
@@ -5377,19 +5653,37 @@ struct CGL_tile
     CGL_vec4 color;
 };
 
+// the top 2 bits of mode select what data holds:
+// 0 = empty, 1 = RGBA8 color, 2 = texture array index,
+// 3 = tileset (x_min, y_min as unorm16 in data, x_max and
+// y_max as unorm15 in the rest of mode)
+struct CGL_tile_packed
+{
+    uint32_t data;
+    uint32_t mode;
+};
+
+#define CGL_TILEMAP_STREAM_REGIONS 3 // tile data in flight, a frame being drawn never waits for the previous ones
+#define CGL_TILEMAP_MERGE_GAP 16 // clean tiles between two dirty runs cheaper to re-send than to split the upload
+
 struct CGL_tilemap
 {
     // tiles data
-    CGL_tile* tile_data;
+    uint8_t* tile_data; // CGL_tile or CGL_tile_packed, see tile_format
+    uint32_t tile_format;
+    size_t tile_stride;
     uint32_t tile_count_x;
     uint32_t tile_count_y;
     uint32_t tile_size_x;
     uint32_t tile_size_y;
     bool auto_update;
+    uint32_t* dirty; // one bit per tile changed since the last upload
+    bool has_dirty;
     // renderer data
     CGL_mesh_gpu* mesh;
     CGL_shader* shader;
     CGL_ssbo* ssbo;
+    bool streaming; // ssbo is a CGL_TILEMAP_STREAM_REGIONS ring, advanced after every render
     // unifrom locations
     int u_tile_count;
     int u_tile_size;
@@ -5401,6 +5695,11 @@ struct CGL_tilemap
 
 
 CGL_tilemap* CGL_tilemap_create(uint32_t tile_count_x, uint32_t tile_count_y, uint32_t tile_size_x, uint32_t tile_size_y, uint32_t ssbo_binding)
+{
+    return CGL_tilemap_create_ex(tile_count_x, tile_count_y, tile_size_x, tile_size_y, ssbo_binding, CGL_TILEMAP_FORMAT_VEC4);
+}
+
+CGL_tilemap* CGL_tilemap_create_ex(uint32_t tile_count_x, uint32_t tile_count_y, uint32_t tile_size_x, uint32_t tile_size_y, uint32_t ssbo_binding, uint32_t flags)
 {
     /*
     assert(tile_count_x > 0);
@@ -5409,13 +5708,24 @@ CGL_tilemap* CGL_tilemap_create(uint32_t tile_count_x, uint32_t tile_count_y, ui
     assert(tile_size_y > 0);
     */
     CGL_tilemap* tilemap = (CGL_tilemap*)malloc(sizeof(CGL_tilemap));
-    tilemap->tile_data = (CGL_tile*)malloc(sizeof(CGL_tile) * tile_count_x * tile_count_y);
-    memset(tilemap->tile_data, 0, (sizeof(CGL_tile) * tile_count_x * tile_count_y));
+    uint32_t tile_format = flags & CGL_TILEMAP_FORMAT_PACKED;
+    tilemap->tile_format = tile_format;
+    tilemap->tile_stride = tile_format == CGL_TILEMAP_FORMAT_PACKED ? sizeof(CGL_tile_packed) : sizeof(CGL_tile);
+    tilemap->tile_data = (uint8_t*)malloc(tilemap->tile_stride * tile_count_x * tile_count_y);
+    memset(tilemap->tile_data, 0, (tilemap->tile_stride * tile_count_x * tile_count_y));
+    tilemap->dirty = (uint32_t*)calloc((tile_count_x * tile_count_y + 31) / 32, sizeof(uint32_t));
+    tilemap->has_dirty = false;
     tilemap->tile_count_x = tile_count_x;
     tilemap->tile_count_y = tile_count_y;
     tilemap->tile_size_x = tile_size_x;
     tilemap->tile_size_y = tile_size_y;
-    tilemap->ssbo = CGL_ssbo_create(ssbo_binding);
+    tilemap->ssbo = NULL;
+    if(flags & CGL_TILEMAP_STREAMING)
+        tilemap->ssbo = CGL_ssbo_create_streaming(ssbo_binding, tilemap->tile_stride * tile_count_x * tile_count_y, CGL_TILEMAP_STREAM_REGIONS);
+    // not asked for, or persistent mapping unavailable (or no tiles)
+    tilemap->streaming = tilemap->ssbo != NULL;
+    if(tilemap->ssbo == NULL)
+        tilemap->ssbo = CGL_ssbo_create(ssbo_binding);
     CGL_mesh_cpu* screen_quad_mesh_cpu = CGL_mesh_cpu_quad((CGL_vec3){ 1.0,  1.0, 0.0},
                                                            (CGL_vec3){ 1.0, -1.0, 0.0},
                                                            (CGL_vec3){-1.0, -1.0, 0.0},
@@ -5425,7 +5735,7 @@ CGL_tilemap* CGL_tilemap_create(uint32_t tile_count_x, uint32_t tile_count_y, ui
     CGL_mesh_cpu_destroy(screen_quad_mesh_cpu);
     tilemap->mesh = screen_quad_mesh_gpu;
     static char shader_source_buffer[1024 * 64];
-    sprintf(shader_source_buffer, __CGL_TILEMAP_FRAGENT_SHADER, ssbo_binding);
+    sprintf(shader_source_buffer, __CGL_TILEMAP_FRAGENT_SHADER, tile_format == CGL_TILEMAP_FORMAT_PACKED ? "#define CGL_TILEMAP_PACKED\n" : "", ssbo_binding, ssbo_binding);
     tilemap->shader = CGL_shader_create(__CGL_TILEMAP_VERTEX_SHADER, shader_source_buffer, NULL);
     tilemap->u_offset = CGL_shader_get_uniform_location(tilemap->shader, "u_offset");
     tilemap->u_scale = CGL_shader_get_uniform_location(tilemap->shader, "u_scale");
@@ -5444,6 +5754,7 @@ void CGL_tilemap_destroy(CGL_tilemap* tilemap)
     CGL_shader_destroy(tilemap->shader);
     CGL_mesh_gpu_destroy(tilemap->mesh);
     free(tilemap->tile_data);
+    free(tilemap->dirty);
     free(tilemap);
 }
 
@@ -5457,38 +5768,93 @@ bool CGL_tilemap_get_auto_upload(CGL_tilemap* tilemap)
     return tilemap->auto_update;
 }
 
+static void __CGL_tilemap_mark_dirty(CGL_tilemap* tilemap, uint32_t index)
+{
+    tilemap->dirty[index >> 5] |= 1u << (index & 31);
+    tilemap->has_dirty = true;
+}
+
+static void __CGL_tilemap_upload_range(CGL_tilemap* tilemap, uint32_t start, uint32_t end)
+{
+    CGL_ssbo_set_sub_data(tilemap->ssbo, start * tilemap->tile_stride, (end - start) * tilemap->tile_stride, tilemap->tile_data + start * tilemap->tile_stride, false);
+}
+
+// uploads every run of dirty tiles with a single call,
+// merging runs less than CGL_TILEMAP_MERGE_GAP tiles apart
+static void __CGL_tilemap_flush(CGL_tilemap* tilemap)
+{
+    uint32_t tile_count = tilemap->tile_count_x * tilemap->tile_count_y;
+    uint32_t start = 0, end = 0;
+    bool in_run = false;
+    for(uint32_t i = 0 ; i < tile_count ; i++)
+    {
+        if(tilemap->dirty[i >> 5] == 0) { i |= 31; continue; } // skip 32 clean tiles at once
+        if(!((tilemap->dirty[i >> 5] >> (i & 31)) & 1)) continue;
+        if(in_run && i - end >= CGL_TILEMAP_MERGE_GAP)
+        {
+            __CGL_tilemap_upload_range(tilemap, start, end);
+            in_run = false;
+        }
+        if(!in_run) { start = i; in_run = true; }
+        end = i + 1;
+    }
+    if(in_run) __CGL_tilemap_upload_range(tilemap, start, end);
+    memset(tilemap->dirty, 0, ((tile_count + 31) / 32) * sizeof(uint32_t));
+    tilemap->has_dirty = false;
+}
+
+// uploads the tiles changed since the last upload
 bool CGL_tilemap_upload(CGL_tilemap* tilemap)
 {
-    CGL_ssbo_set_data(tilemap->ssbo, (sizeof(CGL_tile) * tilemap->tile_count_x * tilemap->tile_count_y), tilemap->tile_data, false);
+    if(tilemap->has_dirty) __CGL_tilemap_flush(tilemap);
     return true;
 }
 
+static uint32_t __CGL_tilemap_unorm(float value, uint32_t max)
+{
+    if(value < 0.0f) value = 0.0f;
+    if(value > 1.0f) value = 1.0f;
+    return (uint32_t)(value * max + 0.5f);
+}
+
+// stores a tile in whichever format the tilemap uses,
+// `value` is its CGL_tile form and packed its other one
+static void __CGL_tilemap_set_tile(CGL_tilemap* tilemap, uint32_t tile_x, uint32_t tile_y, CGL_vec4 value, CGL_tile_packed packed)
+{
+    uint32_t index = tile_y * tilemap->tile_count_x + tile_x;
+    if(tilemap->tile_format == CGL_TILEMAP_FORMAT_PACKED) ((CGL_tile_packed*)tilemap->tile_data)[index] = packed;
+    else ((CGL_tile*)tilemap->tile_data)[index].color = value;
+    __CGL_tilemap_mark_dirty(tilemap, index);
+}
+
 void CGL_tilemap_set_tile_color(CGL_tilemap* tilemap, uint32_t tile_x, uint32_t tile_y, float r, float g, float b)
 {
-    CGL_tile* tile = &tilemap->tile_data[tile_y * tilemap->tile_count_x + tile_x];
-    tile->color = CGL_vec4_init(r, g, b, 2.5f);
-    if(tilemap->auto_update) CGL_ssbo_set_sub_data(tilemap->ssbo, (tile_y * tilemap->tile_count_x + tile_x) * sizeof(CGL_tile), sizeof(CGL_tile), tile, false);
+    CGL_tile_packed packed;
+    packed.data = __CGL_tilemap_unorm(r, 255) | (__CGL_tilemap_unorm(g, 255) << 8) | (__CGL_tilemap_unorm(b, 255) << 16) | (255u << 24);
+    packed.mode = 1u << 30;
+    __CGL_tilemap_set_tile(tilemap, tile_x, tile_y, CGL_vec4_init(r, g, b, 2.5f), packed);
 }
 
 void CGL_tilemap_set_tile_texture_from_array(CGL_tilemap* tilemap, uint32_t tile_x, uint32_t tile_y, uint32_t texture_index)
 {
-    CGL_tile* tile = &tilemap->tile_data[tile_y * tilemap->tile_count_x + tile_x];
-    tile->color = CGL_vec4_init((float)texture_index, 0.0f, 0.0f, 1.5f);
-    if(tilemap->auto_update) CGL_ssbo_set_sub_data(tilemap->ssbo, (tile_y * tilemap->tile_count_x + tile_x) * sizeof(CGL_tile), sizeof(CGL_tile), tile, false);
+    CGL_tile_packed packed;
+    packed.data = texture_index;
+    packed.mode = 2u << 30;
+    __CGL_tilemap_set_tile(tilemap, tile_x, tile_y, CGL_vec4_init((float)texture_index, 0.0f, 0.0f, 1.5f), packed);
 }
 
 void CGL_tilemap_set_tile_texture_from_tileset(CGL_tilemap* tilemap, uint32_t tile_x, uint32_t tile_y, float texture_x_min, float texture_y_min, float texture_x_max, float texture_y_max)
 {
-    CGL_tile* tile = &tilemap->tile_data[tile_y * tilemap->tile_count_x + tile_x];
-    tile->color = CGL_vec4_init(texture_x_min, texture_y_min, texture_x_max, texture_y_max);
-    if(tilemap->auto_update) CGL_ssbo_set_sub_data(tilemap->ssbo, (tile_y * tilemap->tile_count_x + tile_x) * sizeof(CGL_tile), sizeof(CGL_tile), tile, false);
+    CGL_tile_packed packed;
+    packed.data = __CGL_tilemap_unorm(texture_x_min, 0xFFFF) | (__CGL_tilemap_unorm(texture_y_min, 0xFFFF) << 16);
+    packed.mode = (3u << 30) | (__CGL_tilemap_unorm(texture_x_max, 0x7FFF) << 15) | __CGL_tilemap_unorm(texture_y_max, 0x7FFF);
+    __CGL_tilemap_set_tile(tilemap, tile_x, tile_y, CGL_vec4_init(texture_x_min, texture_y_min, texture_x_max, texture_y_max), packed);
 }
 
 void CGL_tilemap_clear_tile(CGL_tilemap* tilemap, uint32_t tile_x, uint32_t tile_y)
 {
-    CGL_tile* tile = &tilemap->tile_data[tile_y * tilemap->tile_count_x + tile_x];
-    tile->color = CGL_vec4_init(0.0f, 0.0f, 0.0f, 3.5f);
-    if(tilemap->auto_update) CGL_ssbo_set_sub_data(tilemap->ssbo, (tile_y * tilemap->tile_count_x + tile_x) * sizeof(CGL_tile), sizeof(CGL_tile), tile, false);
+    CGL_tile_packed packed = {0, 0};
+    __CGL_tilemap_set_tile(tilemap, tile_x, tile_y, CGL_vec4_init(0.0f, 0.0f, 0.0f, 3.5f), packed);
 }
 
 void CGL_tilemap_reset(CGL_tilemap* tilemap)
@@ -5497,15 +5863,17 @@ void CGL_tilemap_reset(CGL_tilemap* tilemap)
     {
         for(uint32_t tile_y = 0 ; tile_y < tilemap->tile_count_y ; tile_y++)
         {
-            CGL_tile* tile = &tilemap->tile_data[tile_y * tilemap->tile_count_x + tile_x];
-            tile->color = CGL_vec4_init(0.0f, 0.0f, 0.0f, 3.5f);
+            CGL_tilemap_clear_tile(tilemap, tile_x, tile_y);
         }
     }
-    CGL_ssbo_set_data(tilemap->ssbo, (sizeof(CGL_tile) * tilemap->tile_count_x * tilemap->tile_count_y), tilemap->tile_data, false);
+    CGL_ssbo_set_data(tilemap->ssbo, (tilemap->tile_stride * tilemap->tile_count_x * tilemap->tile_count_y), tilemap->tile_data, false);
+    memset(tilemap->dirty, 0, ((tilemap->tile_count_x * tilemap->tile_count_y + 31) / 32) * sizeof(uint32_t));
+    tilemap->has_dirty = false;
 }
 
 void CGL_tilemap_render(CGL_tilemap* tilemap, float scale_x, float scale_y, float offset_x, float offset_y, CGL_texture* texture)
 {
+    if(tilemap->auto_update && tilemap->has_dirty) __CGL_tilemap_flush(tilemap);
     CGL_shader_bind(tilemap->shader);
     if(texture) CGL_texture_bind(texture, 0);
     CGL_shader_set_uniform_vec2v(tilemap->shader, tilemap->u_offset, -offset_x, -offset_y);
@@ -5515,6 +5883,7 @@ void CGL_tilemap_render(CGL_tilemap* tilemap, float scale_x, float scale_y, floa
     CGL_shader_set_uniform_int(tilemap->shader, tilemap->u_texture_tileset, 0);
     CGL_shader_set_uniform_int(tilemap->shader, tilemap->u_texture_array, 0);
     CGL_mesh_gpu_render(tilemap->mesh);
+    if(tilemap->streaming) CGL_ssbo_stream_advance(tilemap->ssbo);
 }
 
 #endif
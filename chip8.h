@@ -12,11 +12,182 @@
 // types
 typedef unsigned char chip8_u8;
 typedef unsigned short chip8_u16;
+typedef unsigned int chip8_u32;
+typedef unsigned long long chip8_u64;
+
+// interpreter cores, pick the one chip8_cycle uses by
+// defining CHIP8_CORE before including this file
+#define CHIP8_CORE_SWITCH 0 // decode every instruction and switch on it
+#define CHIP8_CORE_PREDECODED 1 // switch on cached predecoded instructions
+#define CHIP8_CORE_THREADED 2 // direct threaded dispatch over predecoded instructions
+
+#ifndef CHIP8_CORE
+#define CHIP8_CORE CHIP8_CORE_SWITCH
+#endif
+
+// quirk profiles, pick the CHIP-8 variant the ROMs expect by
+// defining CHIP8_QUIRKS before including this file. Every
+// core (and the JIT) is built for that one profile, so
+// there is no quirk check left at run time. Single quirks
+// can still be overridden by defining CHIP8_QUIRK_* too.
+#define CHIP8_QUIRKS_COWGOD 0 // Cowgod's reference semantics with none of the quirks below
+#define CHIP8_QUIRKS_COSMAC_VIP 1 // the original interpreter
+#define CHIP8_QUIRKS_SUPER_CHIP 2 // SUPER-CHIP 1.1 on the HP 48
+#define CHIP8_QUIRKS_XO_CHIP 3 // Octo
+
+#ifndef CHIP8_QUIRKS
+#define CHIP8_QUIRKS CHIP8_QUIRKS_COWGOD
+#endif
+
+#ifndef CHIP8_QUIRK_SHIFT_VY // 8XY6/8XYE shift Vy into Vx instead of shifting Vx
+#define CHIP8_QUIRK_SHIFT_VY (CHIP8_QUIRKS == CHIP8_QUIRKS_COSMAC_VIP || CHIP8_QUIRKS == CHIP8_QUIRKS_XO_CHIP)
+#endif
+
+#ifndef CHIP8_QUIRK_LOAD_STORE_I // FX55/FX65 leave I pointing past the last register
+#define CHIP8_QUIRK_LOAD_STORE_I (CHIP8_QUIRKS == CHIP8_QUIRKS_COSMAC_VIP || CHIP8_QUIRKS == CHIP8_QUIRKS_XO_CHIP)
+#endif
+
+#ifndef CHIP8_QUIRK_JUMP_VX // BXNN jumps to XNN + VX instead of BNNN to NNN + V0
+#define CHIP8_QUIRK_JUMP_VX (CHIP8_QUIRKS == CHIP8_QUIRKS_SUPER_CHIP)
+#endif
+
+#ifndef CHIP8_QUIRK_VF_RESET // 8XY1/8XY2/8XY3 clear VF
+#define CHIP8_QUIRK_VF_RESET (CHIP8_QUIRKS == CHIP8_QUIRKS_COSMAC_VIP)
+#endif
+
+#ifndef CHIP8_QUIRK_CLIP // sprites are cut off at the edges instead of wrapping around
+#define CHIP8_QUIRK_CLIP (CHIP8_QUIRKS == CHIP8_QUIRKS_COSMAC_VIP || CHIP8_QUIRKS == CHIP8_QUIRKS_SUPER_CHIP)
+#endif
+
+// operation kinds of a predecoded instruction
+#define CHIP8__OPS(X) \
+    X(HALT, halt) \
+    X(CLS, cls) \
+    X(RET, ret) \
+    X(SYS, sys) \
+    X(JP, jp) \
+    X(CALL, call) \
+    X(SE_VX_NN, se_vx_nn) \
+    X(SNE_VX_NN, sne_vx_nn) \
+    X(SE_VX_VY, se_vx_vy) \
+    X(LD_VX_NN, ld_vx_nn) \
+    X(ADD_VX_NN, add_vx_nn) \
+    X(LD_VX_VY, ld_vx_vy) \
+    X(OR, or) \
+    X(AND, and) \
+    X(XOR, xor) \
+    X(ADD_VX_VY, add_vx_vy) \
+    X(SUB, sub) \
+    X(SHR, shr) \
+    X(SUBN, subn) \
+    X(SHL, shl) \
+    X(SNE_VX_VY, sne_vx_vy) \
+    X(LD_I_NNN, ld_i_nnn) \
+    X(JP_V0, jp_v0) \
+    X(RND, rnd) \
+    X(DRW, drw) \
+    X(SKP, skp) \
+    X(SKNP, sknp) \
+    X(LD_VX_DT, ld_vx_dt) \
+    X(LD_VX_K, ld_vx_k) \
+    X(LD_DT_VX, ld_dt_vx) \
+    X(LD_ST_VX, ld_st_vx) \
+    X(ADD_I_VX, add_i_vx) \
+    X(LD_F_VX, ld_f_vx) \
+    X(LD_B_VX, ld_b_vx) \
+    X(LD_MEM_VX, ld_mem_vx) \
+    X(LD_VX_MEM, ld_vx_mem) \
+    X(UNKNOWN, unknown)
+
+#define CHIP8__OP_ENUM(name, func) CHIP8_OP_##name,
+enum chip8_op
+{
+    CHIP8_OP_UNDECODED = 0, // slot not decoded yet (or invalidated by a write)
+    CHIP8__OPS(CHIP8__OP_ENUM)
+    CHIP8_OP_COUNT
+};
+#undef CHIP8__OP_ENUM
+
+// an instruction pulled apart once so that
+// running it again does not have to decode it, kept to 4
+// bytes: n and nnn overlap x and nn, see CHIP8_INSN_N and
+// CHIP8_INSN_NNN
+struct chip8_insn
+{
+    chip8_u8 op; // enum chip8_op
+    chip8_u8 x;
+    chip8_u8 y;
+    chip8_u8 nn;
+};
+
+#define CHIP8_INSN_N(insn) ((chip8_u8)((insn)->nn & 0x0F))
+#define CHIP8_INSN_NNN(insn) ((chip8_u16)(((insn)->x << 8) | (insn)->nn))
+
+// why chip8_run stopped
+enum chip8_exit
+{
+    CHIP8_EXIT_NONE = 0, // ran all the cycles it was asked to
+    CHIP8_EXIT_DISPLAY, // the display changed (only with CHIP8_STOP_DISPLAY)
+    CHIP8_EXIT_KEY_WAIT, // LD Vx, K is waiting for a key, nothing changes until the input does
+    CHIP8_EXIT_BREAKPOINT, // PC reached a breakpoint
+    CHIP8_EXIT_HALT, // reached a 0000 instruction
+    CHIP8_EXIT_STACK_OVERFLOW,
+    CHIP8_EXIT_STACK_UNDERFLOW,
+    CHIP8_EXIT_PC_OUT_OF_RANGE
+};
+
+// the program can not continue after these
+#define CHIP8_EXIT_IS_FATAL(reason) ((reason) >= CHIP8_EXIT_HALT)
+#define CHIP8__EXIT_IDLE 0xFF // internal, a JP landed on an idle loop (see chip8__idle_length), never returned by chip8_run
+
+// optional reasons for chip8_run to stop early (vm->stop_flags)
+#define CHIP8_STOP_DISPLAY 0b00000001
+
+#define CHIP8_TIMER_HZ 60 // DT and ST always count down at this rate
+#define CHIP8_DEFAULT_CLOCK_HZ 600
+#define CHIP8_DEFAULT_SEED 0
+
+// one executed instruction in a chip8_trace
+struct chip8_trace_entry
+{
+    chip8_u16 PC;
+    chip8_u16 opcode;
+    chip8_u16 I; // after the instruction
+    chip8_u8 reg; // register it changed (VF only if it changed no other), CHIP8_TRACE_NO_REG if none
+    chip8_u8 value; // the new value of reg
+};
+
+#define CHIP8_TRACE_NO_REG 0xFF
+#define CHIP8_TRACE_TEXT_SIZE 48 // chars chip8_trace_format may write
+
+#define CHIP8_DISASSEMBLY_SIZE 24 // chars chip8_disassemble may write
+#define CHIP8_DISASSEMBLY_LINE_SIZE 32 // chars per line of chip8_disassemble_range
+
+// ring buffer of the last instructions a VM ran, see
+// chip8_set_trace
+struct chip8_trace
+{
+    struct chip8_trace_entry* entries; // capacity entries, owned by the caller
+    chip8_u32 capacity; // a power of two
+    chip8_u64 count; // entries ever recorded, entry n lives at entries[n & (capacity - 1)]
+};
+
+// parts of the display that changed, see chip8_consume_dirty
+struct chip8_dirty
+{
+    chip8_u32 rows; // bit y set if row y changed
+    chip8_u64 columns; // bit 63 - x set if column x changed (the bit order of a packed row)
+};
 
 struct chip8
 {    
     chip8_u8 memory[4096];
-    chip8_u8 display[64 * 32];
+    struct chip8_insn decoded[4096 / 2]; // predecoded instruction for every even address
+#ifdef CHIP8_PACKED_DISPLAY
+    chip8_u64 display[32]; // one word per row, bit 63 is the leftmost pixel
+#else
+    chip8_u8 display[64 * 32]; // one byte per pixel, 1 = lit
+#endif
     chip8_u16 stack[16];
     chip8_u8 regs[16];
     chip8_u16 opcode;
@@ -25,24 +196,59 @@ struct chip8
     chip8_u8 SP; // stack pointer
     chip8_u8 DT; // delay timer
     chip8_u8 ST; // sound timer
+    chip8_u64 cycles; // instructions run since the ROM was loaded
+    chip8_u64 idle_cycles; // the part of cycles skipped over idle loops (see chip8__skip_idle) rather than run
+    chip8_u8 stop_flags; // CHIP8_STOP_*, kept across ROM loads
+    chip8_u16 breakpoint_count; // kept across ROM loads
+    chip8_u8 breakpoints[4096 / 8]; // one bit per address
+    chip8_u32 clock_hz; // instructions per second, 0 = unlimited (kept across ROM loads)
+    chip8_u64 seed; // RND seed, see chip8_seed (kept across ROM loads)
+    chip8_u64 rng; // xorshift64* state RND draws from, restarts from seed on ROM loads
+    chip8_u32 frame_cycles; // instructions left in the current 60 Hz frame
+    chip8_u8 frame_open; // frame_cycles was budgeted and the frame's timer tick is still pending
+    chip8_u8 key_wait; // 1 + the key LD Vx, K saw pressed and now waits to be released, 0 = none yet
+    chip8_u32 clock_phase; // remainder of clock_hz / 60 carried between frames
+    chip8_u32 generation; // changes whenever a ROM load replaces the memory
+    struct chip8_dirty dirty; // changed since the last chip8_consume_dirty
+    struct chip8_trace* trace; // NULL = not tracing (kept across ROM loads)
 };
 
 void chip8_init(struct chip8* vm);
 chip8_u8 chip8_load_rom(struct chip8* vm, const chip8_u8* data, chip8_u16 data_size);
 void chip8_update_timer(struct chip8* vm);
+void chip8_unpack_display(const struct chip8* vm, chip8_u8* pixels);
+struct chip8_dirty chip8_consume_dirty(struct chip8* vm);
+chip8_u8 chip8_run_frame(struct chip8* vm, const chip8_u8* input);
+chip8_u8 chip8_run_frame_part(struct chip8* vm, const chip8_u8* input, chip8_u32 max_cycles);
 chip8_u8 chip8_cycle(struct chip8* vm, const chip8_u8* input);
+chip8_u8 chip8_cycle_switch(struct chip8* vm, const chip8_u8* input);
+chip8_u8 chip8_cycle_predecoded(struct chip8* vm, const chip8_u8* input);
+chip8_u8 chip8_run(struct chip8* vm, const chip8_u8* input, chip8_u32 max_cycles);
+chip8_u8 chip8_run_switch(struct chip8* vm, const chip8_u8* input, chip8_u32 max_cycles);
+chip8_u8 chip8_run_predecoded(struct chip8* vm, const chip8_u8* input, chip8_u32 max_cycles);
+chip8_u8 chip8_run_threaded(struct chip8* vm, const chip8_u8* input, chip8_u32 max_cycles);
+void chip8_set_breakpoint(struct chip8* vm, chip8_u16 address, chip8_u8 enabled);
+void chip8_seed(struct chip8* vm, chip8_u64 seed);
+void chip8_trace_init(struct chip8_trace* trace, struct chip8_trace_entry* entries, chip8_u32 capacity);
+void chip8_set_trace(struct chip8* vm, struct chip8_trace* trace);
+const struct chip8_trace_entry* chip8_trace_get(const struct chip8_trace* trace, chip8_u64 back);
+void chip8_trace_format(const struct chip8_trace_entry* entry, char* buffer);
+int chip8_disassemble(const chip8_u8* memory, chip8_u16 address, char* buffer);
+chip8_u32 chip8_disassemble_range(const chip8_u8* memory, chip8_u16 start, chip8_u16 end, char* buffer, chip8_u32 size);
+
+#ifdef CHIP8_JIT
+struct chip8_jit;
+struct chip8_jit* chip8_jit_create(void);
+void chip8_jit_destroy(struct chip8_jit* jit);
+void chip8_jit_invalidate(struct chip8_jit* jit, chip8_u16 address, chip8_u16 size);
+chip8_u8 chip8_run_jit(struct chip8_jit* jit, struct chip8* vm, const chip8_u8* input, chip8_u32 max_cycles);
+#endif
+void chip8_invalidate(struct chip8* vm, chip8_u16 address, chip8_u16 size);
 
 
 #ifdef CHIP8_IMPLEMENTATION
 
-#ifndef chip8_log
-#define chip8_log(...)
-#endif
-
-#ifndef chip8_rand
-#include <stdlib.h>
-#define chip8_rand rand
-#endif
+#include <stddef.h>
 
 static const chip8_u8 font[16 * 5] =
 {
@@ -87,10 +293,55 @@ static chip8_u8 chip8__to_u8(char hex)
     return hex - '0' + 10;
 }
 
-void chip8_init(struct chip8* vm)
+// splitmix64, spreads any seed (0 included) over a
+// state xorshift can start from
+static chip8_u64 chip8__seed_state(chip8_u64 seed)
+{
+    chip8_u64 z = seed + 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z = z ^ (z >> 31);
+    return z ? z : 1;
+}
+
+// next byte of the VM's own xorshift64* stream, all 256
+// values equally likely
+static chip8_u8 chip8__random(struct chip8* vm)
+{
+    chip8_u64 x = vm->rng;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    vm->rng = x;
+    return (chip8_u8)((x * 0x2545F4914F6CDD1DULL) >> 56);
+}
+
+// source of vm->generation, unique across all VMs so that
+// a re-initialised VM never looks like one seen before.
+// ROMs may be loaded from several threads at once, a lost
+// update could hand a VM back its previous generation and
+// the JIT would keep running code of the old ROM.
+#ifdef _MSC_VER
+#include <intrin.h>
+static volatile long chip8__generations = 0;
+#else
+static chip8_u32 chip8__generations = 0;
+#endif
+
+static chip8_u32 chip8__next_generation(void)
+{
+#ifdef _MSC_VER
+    return (chip8_u32)_InterlockedIncrement(&chip8__generations);
+#else
+    return __atomic_add_fetch(&chip8__generations, 1, __ATOMIC_RELAXED);
+#endif
+}
+
+static void chip8__reset(struct chip8* vm)
 {
     chip8__memset(vm->memory, 4096, 0);
-    chip8__memset(vm->display, 64 * 32, 0);
+    chip8__memset((chip8_u8*)vm->decoded, sizeof(vm->decoded), 0);
+    chip8__memset((chip8_u8*)vm->display, sizeof(vm->display), 0);
     chip8__memset((chip8_u8*)vm->stack, 2 * 16, 0);
     chip8__memset(vm->regs, 16, 0);
     chip8__memcpy(vm->memory, font, 16 * 5);
@@ -99,37 +350,409 @@ void chip8_init(struct chip8* vm)
     vm->SP = 0;
     vm->DT = 0;
     vm->ST = 0;
+    vm->cycles = 0;
+    vm->idle_cycles = 0;
+    vm->generation = chip8__next_generation();
+    vm->frame_cycles = 0;
+    vm->frame_open = false;
+    vm->key_wait = 0;
+    vm->clock_phase = 0;
+    vm->rng = chip8__seed_state(vm->seed);
+    vm->dirty.rows = 0xFFFFFFFF;
+    vm->dirty.columns = ~(chip8_u64)0;
 }
 
+void chip8_init(struct chip8* vm)
+{
+    vm->stop_flags = 0;
+    vm->breakpoint_count = 0;
+    vm->clock_hz = CHIP8_DEFAULT_CLOCK_HZ;
+    vm->seed = CHIP8_DEFAULT_SEED;
+    vm->trace = NULL;
+    chip8__memset(vm->breakpoints, sizeof(vm->breakpoints), 0);
+    chip8__reset(vm);
+}
 
+// Unlike chip8_init this keeps the configuration of the
+// VM (stop flags and breakpoints) intact.
 chip8_u8 chip8_load_rom(struct chip8* vm, const chip8_u8* data, chip8_u16 data_size)
 {
     if((data_size - 512) >= 4096) return false;
-    chip8_init(vm);
+    chip8__reset(vm);
     chip8__memcpy(vm->memory + 0x200, data, data_size);
     return true;
 }
 
+void chip8_invalidate(struct chip8* vm, chip8_u16 address, chip8_u16 size)
+{
+    // an instruction starting at an even address covers
+    // that byte and the next one, so any written byte
+    // only ever belongs to the slot of (address & ~1)
+    for(chip8_u16 i = 0 ; i < size ; i++) vm->decoded[((address + i) >> 1) & 2047].op = CHIP8_OP_UNDECODED;
+}
+
+void chip8_set_breakpoint(struct chip8* vm, chip8_u16 address, chip8_u8 enabled)
+{
+    chip8_u8 mask = (chip8_u8)(1 << (address & 7));
+    chip8_u8* bits = &vm->breakpoints[(address >> 3) & 511];
+    if(enabled && !(*bits & mask)) { *bits |= mask; vm->breakpoint_count++; }
+    if(!enabled && (*bits & mask)) { *bits &= ~mask; vm->breakpoint_count--; }
+}
+
+// Sets up an empty trace over `capacity` (a power of two)
+// preallocated entries.
+void chip8_trace_init(struct chip8_trace* trace, struct chip8_trace_entry* entries, chip8_u32 capacity)
+{
+    trace->entries = entries;
+    trace->capacity = capacity;
+    trace->count = 0;
+}
+
+// Starts recording every instruction the VM runs into the
+// trace, or stops with NULL. While tracing, all cores (and
+// the JIT) step through the predecoded core one
+// instruction at a time; when not tracing it costs one
+// check per chip8_run call. Polling loops that get fast
+// forwarded are recorded once per run.
+void chip8_set_trace(struct chip8* vm, struct chip8_trace* trace)
+{
+    vm->trace = trace;
+}
+
+// The entry `back` instructions before the last one
+// recorded, NULL if it was not recorded or already
+// overwritten.
+const struct chip8_trace_entry* chip8_trace_get(const struct chip8_trace* trace, chip8_u64 back)
+{
+    if(back >= trace->count || back >= trace->capacity) return NULL;
+    return &trace->entries[(trace->count - 1 - back) & (trace->capacity - 1)];
+}
+
+static char* chip8__put_hex(char* out, chip8_u16 value, chip8_u8 digits)
+{
+    for(chip8_u8 i = 0 ; i < digits ; i++) out[i] = chip8__to_hex((value >> (4 * (digits - 1 - i))) & 0xF);
+    return out + digits;
+}
+
+static char* chip8__put_text(char* out, const char* text)
+{
+    while(*text) *out++ = *text++;
+    return out;
+}
+
+static char* chip8__disassemble_opcode(chip8_u16 opcode, char* out);
+
+// Writes an entry out as text, e.g.
+// "2A4: 8124  ADD V1, V2  I=300  V1=05", into a buffer of at
+// least CHIP8_TRACE_TEXT_SIZE chars. Formatting only ever
+// happens here, when a trace is read.
+void chip8_trace_format(const struct chip8_trace_entry* entry, char* buffer)
+{
+    char* out = chip8__put_hex(buffer, entry->PC, 3);
+    out = chip8__put_text(out, ": ");
+    out = chip8__put_hex(out, entry->opcode, 4);
+    out = chip8__put_text(out, "  ");
+    out = chip8__disassemble_opcode(entry->opcode, out);
+    out = chip8__put_text(out, "  I=");
+    out = chip8__put_hex(out, entry->I, 3);
+    if(entry->reg != CHIP8_TRACE_NO_REG)
+    {
+        out = chip8__put_text(out, "  V");
+        out = chip8__put_hex(out, entry->reg, 1);
+        *out++ = '=';
+        out = chip8__put_hex(out, entry->value, 2);
+    }
+    *out = '\0';
+}
+
+// Seeds RND. The same seed gives the same random bytes on
+// every core and every VM, and each ROM load starts over
+// from it.
+void chip8_seed(struct chip8* vm, chip8_u64 seed)
+{
+    vm->seed = seed;
+    vm->rng = chip8__seed_state(seed);
+}
+
+static chip8_u8 chip8__is_breakpoint(const struct chip8* vm, chip8_u16 address)
+{
+    return (vm->breakpoints[address >> 3] >> (address & 7)) & 1;
+}
+
 void chip8_update_timer(struct chip8* vm)
 {
     if(vm->DT > 0) vm->DT--;
     if(vm->ST > 0) vm->ST--;
 }
 
+// Writes the display to `pixels` as 64 * 32 bytes, row by
+// row with 1 for a lit pixel, whichever layout vm->display
+// uses.
+void chip8_unpack_display(const struct chip8* vm, chip8_u8* pixels)
+{
+#ifdef CHIP8_PACKED_DISPLAY
+    for(chip8_u16 y = 0 ; y < 32 ; y++)
+        for(chip8_u16 x = 0 ; x < 64 ; x++)
+            pixels[y * 64 + x] = (chip8_u8)((vm->display[y] >> (63 - x)) & 1);
+#else
+    chip8__memcpy(pixels, vm->display, 64 * 32);
+#endif
+}
+
+// Returns which rows and columns of the display changed
+// since the last call (everything after a ROM load) and
+// starts tracking afresh. Every changed pixel lies in one
+// of the rows and one of the columns, so together they
+// also give a bounding rectangle; nothing changed if rows
+// is 0.
+struct chip8_dirty chip8_consume_dirty(struct chip8* vm)
+{
+    struct chip8_dirty dirty = vm->dirty;
+    vm->dirty.rows = 0;
+    vm->dirty.columns = 0;
+    return dirty;
+}
+
+// LD Vx, K waits for a key to be pressed and released,
+// like the COSMAC VIP, then stores it in Vx. Returns
+// CHIP8_EXIT_NONE once it did, the caller then moves on.
+static chip8_u8 chip8__wait_key(struct chip8* vm, chip8_u8 x, const chip8_u8* input)
+{
+    if(vm->key_wait == 0)
+    {
+        for(chip8_u8 key = 0 ; key < 16 ; key++)
+        {
+            if(input[key])
+            {
+                vm->key_wait = key + 1;
+                break;
+            }
+        }
+        return CHIP8_EXIT_KEY_WAIT;
+    }
+    if(input[vm->key_wait - 1]) return CHIP8_EXIT_KEY_WAIT;
+    vm->regs[x] = vm->key_wait - 1;
+    vm->key_wait = 0;
+    return CHIP8_EXIT_NONE;
+}
+
+// Idle loops
+//
+// Polling loops like these spin without changing anything
+// but PC until a timer tick or the input does, and neither
+// can happen in the middle of a chip8_run:
+//   JP self
+//   SKP/SKNP Vx; JP back            while the key does not skip
+//   LD Vx, DT; SE Vx, NN; JP back   while DT != NN
+// The cores check for them whenever a JP goes backwards and
+// skip as many whole iterations as the cycle budget allows.
+// Returns the length of the loop at PC, 0 if there is none.
+static chip8_u8 chip8__idle_length(const struct chip8* vm, const chip8_u8* input)
+{
+    chip8_u16 pc = vm->PC;
+    if(pc > 4096 - 6 || vm->breakpoint_count) return 0;
+    const chip8_u8* code = &vm->memory[pc];
+    chip8_u8 jump_high = 0x10 | (pc >> 8), jump_low = pc & 0xFF; // JP pc
+    if(code[0] == jump_high && code[1] == jump_low) return 1;
+    chip8_u8 x = code[0] & 0x0F;
+    if((code[0] >> 4) == 0xE && code[2] == jump_high && code[3] == jump_low && vm->regs[x] < 16)
+    {
+        if(code[1] == 0x9E && !input[vm->regs[x]]) return 2;
+        if(code[1] == 0xA1 && input[vm->regs[x]]) return 2;
+        return 0;
+    }
+    if((code[0] >> 4) == 0xF && code[1] == 0x07 && code[2] == (0x30 | x) && code[3] != vm->DT && code[4] == jump_high && code[5] == jump_low) return 3;
+    return 0;
+}
+
+// Skips as many whole iterations of the idle loop at PC as
+// fit in `remaining` cycles and returns how many cycles that
+// was, the caller counts them as run. They are added to
+// idle_cycles as well.
+static chip8_u32 chip8__skip_idle(struct chip8* vm, const chip8_u8* input, chip8_u32 remaining)
+{
+    chip8_u8 length = chip8__idle_length(vm, input);
+    if(length == 0) return 0;
+    chip8_u32 skipped = remaining - remaining % length;
+    if(length == 3 && skipped > 0) vm->regs[vm->memory[vm->PC] & 0x0F] = vm->DT; // what LD Vx, DT left there
+    vm->idle_cycles += skipped;
+    return skipped;
+}
+
+static void chip8__clear_display(struct chip8* vm)
+{
+    // only rows that had lit pixels change
+    for(chip8_u16 y = 0 ; y < 32 ; y++)
+    {
+#ifdef CHIP8_PACKED_DISPLAY
+        chip8_u64 row = vm->display[y];
+#else
+        chip8_u64 row = 0;
+        for(chip8_u16 x = 0 ; x < 64 ; x++) row |= (chip8_u64)vm->display[y * 64 + x] << (63 - x);
+#endif
+        if(row == 0) continue;
+        vm->dirty.rows |= (chip8_u32)1 << y;
+        vm->dirty.columns |= row;
+    }
+    chip8__memset((chip8_u8*)vm->display, sizeof(vm->display), 0);
+}
+
+// I is 16 bits wide and FX1E can push it past 0xFFF, so
+// every access through it wraps around the 4 KB of memory
+// like the 12 bit address bus it stands for. Nothing past
+// vm->memory (the predecoded slots live right after it)
+// is ever read or written.
+#define CHIP8__AT_I(vm, offset) ((vm)->memory[((vm)->I + (offset)) & 0xFFF])
+
+// FX55, stores V0 through V(count - 1) at I
+static void chip8__store_regs(struct chip8* vm, chip8_u8 count)
+{
+    for(chip8_u8 i = 0 ; i < count ; i++) CHIP8__AT_I(vm, i) = vm->regs[i];
+    chip8_invalidate(vm, vm->I, count);
+}
+
+// FX65, loads V0 through V(count - 1) from I
+static void chip8__load_regs(struct chip8* vm, chip8_u8 count)
+{
+    for(chip8_u8 i = 0 ; i < count ; i++) vm->regs[i] = CHIP8__AT_I(vm, i);
+}
+
+// XORs the `height` byte sprite at I onto the display at
+// (x_loc, y_loc), wrapping around the edges (or cut off at
+// them with CHIP8_QUIRK_CLIP), and sets VF if that erased
+// any pixel. The position itself always wraps.
+static void chip8__draw(struct chip8* vm, chip8_u8 x_loc, chip8_u8 y_loc, chip8_u8 height)
+{
+    // a sprite row starts in the top byte and is rotated
+    // right into place, so wrapping on x comes for free
+    chip8_u8 shift = x_loc % 64;
+    chip8_u64 collision = 0;
+    y_loc %= 32;
+#if CHIP8_QUIRK_CLIP
+    if(height > 32 - y_loc) height = 32 - y_loc;
+#endif
+    for(chip8_u16 y = 0 ; y < height ; y++)
+    {
+        chip8_u16 line = (y_loc + y) % 32;
+        chip8_u64 row = (chip8_u64)CHIP8__AT_I(vm, y) << 56;
+#if CHIP8_QUIRK_CLIP
+        row >>= shift;
+#else
+        if(shift) row = (row >> shift) | (row << (64 - shift));
+#endif
+        if(row == 0) continue;
+        // every set sprite bit flips its pixel
+        vm->dirty.rows |= (chip8_u32)1 << line;
+        vm->dirty.columns |= row;
+#ifdef CHIP8_PACKED_DISPLAY
+        collision |= vm->display[line] & row;
+        vm->display[line] ^= row;
+#else
+        chip8_u8 pixel = CHIP8__AT_I(vm, y);
+        for(chip8_u16 x = 0 ; x < 8 ; x++ )
+        {
+            if((pixel & (0x80 >> x)) != 0)
+            {
+#if CHIP8_QUIRK_CLIP
+                if(shift + x >= 64) break;
+#endif
+                chip8_u16 xf = (shift + x) % 64;
+                collision |= vm->display[line * 64 + xf];
+                vm->display[line * 64 + xf] ^= 1;
+            }
+        }
+#endif
+    }
+    vm->regs[15] = collision != 0;
+}
+
+// Runs at most max_cycles of the instructions left in the
+// current 1/60 s frame, opening a new frame (budgeting its
+// clock_hz / 60 instructions, with the remainder carried
+// over so e.g. 500 Hz alternates between 8 and 9) if none
+// is open, but never ends it. A key wait idles out the
+// rest of max_cycles as nothing can change before the
+// input does. This lets a frontend change the input in
+// the middle of a frame; with max_cycles 0 it only opens
+// the frame so vm->frame_cycles tells its length.
+chip8_u8 chip8_run_frame_part(struct chip8* vm, const chip8_u8* input, chip8_u32 max_cycles)
+{
+    if(!vm->frame_open)
+    {
+        vm->clock_phase += vm->clock_hz;
+        vm->frame_cycles = vm->clock_phase / CHIP8_TIMER_HZ;
+        vm->clock_phase %= CHIP8_TIMER_HZ;
+        vm->frame_open = true;
+    }
+    if(max_cycles > vm->frame_cycles) max_cycles = vm->frame_cycles;
+    if(max_cycles == 0) return CHIP8_EXIT_NONE;
+    chip8_u64 before = vm->cycles;
+    chip8_u8 reason = chip8_run(vm, input, max_cycles);
+    chip8_u32 ran = (chip8_u32)(vm->cycles - before);
+    if(reason == CHIP8_EXIT_KEY_WAIT)
+    {
+        vm->cycles += max_cycles - ran;
+        ran = max_cycles;
+    }
+    vm->frame_cycles -= ran;
+    return reason;
+}
+
+// Runs what is left of the current 1/60 s frame, then
+// ticks the timers once. If chip8_run stops early the
+// reason is returned with the frame still open and the
+// next call picks it up where it left off; the exception
+// is a key wait, which idles out the rest of the frame.
+// With clock_hz set to 0 (unlimited) frames carry no
+// instructions and the caller drives the CPU through
+// chip8_run instead.
+chip8_u8 chip8_run_frame(struct chip8* vm, const chip8_u8* input)
+{
+    chip8_u8 reason = chip8_run_frame_part(vm, input, 0xFFFFFFFF);
+    if(vm->frame_cycles > 0) return reason;
+    chip8_update_timer(vm);
+    vm->frame_open = false;
+    return reason;
+}
 
-// NOTE: The notes about the instructions are taken from : http://devernay.free.fr/hacks/chip8/C8TECH10.HTM#00Cn
 
 chip8_u8 chip8_cycle(struct chip8* vm, const chip8_u8* input)
+{
+#if CHIP8_CORE == CHIP8_CORE_THREADED
+    return !CHIP8_EXIT_IS_FATAL(chip8_run_threaded(vm, input, 1));
+#elif CHIP8_CORE == CHIP8_CORE_PREDECODED
+    return chip8_cycle_predecoded(vm, input);
+#else
+    return chip8_cycle_switch(vm, input);
+#endif
+}
+
+chip8_u8 chip8_run(struct chip8* vm, const chip8_u8* input, chip8_u32 max_cycles)
+{
+#if CHIP8_CORE == CHIP8_CORE_THREADED
+    return chip8_run_threaded(vm, input, max_cycles);
+#elif CHIP8_CORE == CHIP8_CORE_PREDECODED
+    return chip8_run_predecoded(vm, input, max_cycles);
+#else
+    return chip8_run_switch(vm, input, max_cycles);
+#endif
+}
+
+// NOTE: The notes about the instructions are taken from : http://devernay.free.fr/hacks/chip8/C8TECH10.HTM#00Cn
+
+// Runs one instruction and returns a CHIP8_EXIT_* reason,
+// CHIP8_EXIT_NONE if there is nothing to report.
+static chip8_u8 chip8__step_switch(struct chip8* vm, const chip8_u8* input)
 {
     chip8_u8 opcode_s = (chip8_u8)((vm->memory[vm->PC] & 0b11110000) >> 4);
     chip8_u8 opcode_x = (chip8_u8)((vm->memory[vm->PC] & 0b00001111));
-    chip8_u8 opcode_y = (chip8_u8)((vm->memory[vm->PC + 1] & 0b11110000) >> 4);
-    chip8_u8 opcode_n = (chip8_u8)((vm->memory[vm->PC + 1] & 0b00001111));
-    chip8_u8 opcode_nn = (chip8_u8)(vm->memory[vm->PC + 1]);
+    chip8_u8 opcode_nn = (chip8_u8)(vm->memory[(vm->PC + 1) & 0xFFF]);
+    chip8_u8 opcode_y = (chip8_u8)((opcode_nn & 0b11110000) >> 4);
+    chip8_u8 opcode_n = (chip8_u8)((opcode_nn & 0b00001111));
     chip8_u16 opcode_nnn = (chip8_u16)(vm->memory[vm->PC] & 0b00001111);
     opcode_nnn = (opcode_nnn << 8);
-    opcode_nnn |= (chip8_u16)(vm->memory[vm->PC + 1]);
-    if(opcode_s == 0 && opcode_x == 0 && opcode_y == 0 && opcode_n == 0)  return false;
+    opcode_nnn |= (chip8_u16)opcode_nn;
+    if(opcode_s == 0 && opcode_x == 0 && opcode_y == 0 && opcode_n == 0)  return CHIP8_EXIT_HALT;
     vm->PC += 2;
 
 
@@ -139,13 +762,12 @@ chip8_u8 chip8_cycle(struct chip8* vm, const chip8_u8* input)
         {
             if(opcode_y == 14 && opcode_n == 0) // CLS (0x00E0)
             {
-                chip8_log("CLS\n");
                 // Clear the display.
-                chip8__memset(vm->display, 64 * 32, 0);
+                chip8__clear_display(vm);
+                return CHIP8_EXIT_DISPLAY;
             }
             else if(opcode_y == 14 && opcode_n == 14) // RET (0x00EE)
             {
-                chip8_log("RET\n");
                 // Return from a subroutine.
                 // The interpreter sets the program
                 // counter to the address at the
@@ -153,15 +775,13 @@ chip8_u8 chip8_cycle(struct chip8* vm, const chip8_u8* input)
                 // 1 from the stack pointer.
                 if(vm->SP == 0)
                 {
-                    chip8_log("Stack Underflow\n");
-                    return false;
+                    return CHIP8_EXIT_STACK_UNDERFLOW;
                 }
                 vm->SP -= 1;
                 vm->PC = vm->stack[vm->SP];
             }
             else // SYS addr (0x0nnn)
             {
-                chip8_log("SYS %d ; (NOT IMPLEMENTED)\n", opcode_nnn);                
                 // Jump to a machine code routine at nnn
                 // This instruction is only used on the
                 // old computers on which Chip-8 was
@@ -172,16 +792,16 @@ chip8_u8 chip8_cycle(struct chip8* vm, const chip8_u8* input)
         }
         case 1: // JP addr (0x1nnn)
         {
-            chip8_log("JP %d\n", opcode_nnn);
             // Jump to location nnn.
             // The interpreter sets the
             // program counter to nnn.
+            chip8_u16 from = vm->PC - 2;
             vm->PC = opcode_nnn;
+            if(opcode_nnn <= from && chip8__idle_length(vm, input)) return CHIP8__EXIT_IDLE;
             break;
         }
         case 2: //  CALL addr (0x2nnn)
         {
-            chip8_log("CALL %d\n", opcode_nnn);
             // Call subroutine at nnn.
             // The interpreter increments
             // the stack pointer, then puts
@@ -190,8 +810,7 @@ chip8_u8 chip8_cycle(struct chip8* vm, const chip8_u8* input)
             // then set to nnn.
             if(vm->SP == 16)
             {
-                chip8_log("Stack Overflow\n");
-                return false;
+                return CHIP8_EXIT_STACK_OVERFLOW;
             }
             vm->stack[vm->SP] = vm->PC;
             vm->SP += 1;
@@ -200,7 +819,6 @@ chip8_u8 chip8_cycle(struct chip8* vm, const chip8_u8* input)
         }
         case 3: // SE Vx, byte (0x3xnn)
         {
-            chip8_log("SE V%c, %d\n", chip8__to_hex(opcode_x), opcode_nn);
             // Skip next instruction if Vx = nn.
             // The interpreter compares register
             // Vx to nn, and if they are equal,
@@ -210,7 +828,6 @@ chip8_u8 chip8_cycle(struct chip8* vm, const chip8_u8* input)
         }
         case 4: // SNE Vx, byte (0x4xnn)
         {
-            chip8_log("SNE V%c, %d\n", chip8__to_hex(opcode_x), opcode_nn);
             //Skip next instruction if Vx != nn.
             //The interpreter compares register
             // Vx to nn, and if they are not equal,
@@ -220,7 +837,6 @@ chip8_u8 chip8_cycle(struct chip8* vm, const chip8_u8* input)
         }
         case 5: // SE Vx, Vy (0x5xy0)
         {
-            chip8_log("SE V%c, V%c \n", chip8__to_hex(opcode_x), chip8__to_hex(opcode_y));
             //Skip next instruction if Vx = Vy.
             //The interpreter compares register
             // Vx to register Vy, and if they are
@@ -231,7 +847,6 @@ chip8_u8 chip8_cycle(struct chip8* vm, const chip8_u8* input)
         }
         case 6: // LD Vx, byte (0x6xnn)
         {
-            chip8_log("LD V%c, %d\n", chip8__to_hex(opcode_x), opcode_nn);
             // Set Vx = nn.
             // The interpreter puts the
             // value nn into register Vx.
@@ -240,7 +855,6 @@ chip8_u8 chip8_cycle(struct chip8* vm, const chip8_u8* input)
         }
         case 7: // ADD Vx, byte (0x7xnn)
         {
-            chip8_log("ADD V%c, %d\n", chip8__to_hex(opcode_x), opcode_nn);
             // Set Vx = Vx + nn.
             // Adds the value nn to the
             // value of register Vx, then
@@ -256,7 +870,6 @@ chip8_u8 chip8_cycle(struct chip8* vm, const chip8_u8* input)
             {
                 case 0: // LD Vx, Vy (0x8xy0)
                 {
-                    chip8_log("LF V%c, V%c", chip8__to_hex(opcode_x), chip8__to_hex(opcode_y));
                     // Set Vx = Vy.
                     // Stores the value of register
                     // Vy in register Vx.
@@ -265,7 +878,6 @@ chip8_u8 chip8_cycle(struct chip8* vm, const chip8_u8* input)
                 }
                 case 1: // OR Vx, Vy (0x8xy1)
                 {
-                    chip8_log("OR V%c, V%c", chip8__to_hex(opcode_x), chip8__to_hex(opcode_y));
                     // Set Vx = Vx OR Vy.
                     // Performs a bitwise OR on the values
                     // of Vx and Vy, then stores the result
@@ -275,11 +887,13 @@ chip8_u8 chip8_cycle(struct chip8* vm, const chip8_u8* input)
                     // bit in the result is also 1. Otherwise,
                     // it is 0.
                     vm->regs[opcode_x] = vm->regs[opcode_x] | vm->regs[opcode_y];
+#if CHIP8_QUIRK_VF_RESET
+                    vm->regs[15] = 0;
+#endif
                     break;
                 }
                 case 2: // AND Vx, Vy (0x8xy2)
                 {
-                    chip8_log("AND V%c, V%c", chip8__to_hex(opcode_x), chip8__to_hex(opcode_y));
                     // Set Vx = Vx AND Vy.
                     // Performs a bitwise AND on the values
                     // of Vx and Vy, then stores the result
@@ -289,11 +903,13 @@ chip8_u8 chip8_cycle(struct chip8* vm, const chip8_u8* input)
                     // bit in the result is also 1. Otherwise,
                     // it is 0.
                     vm->regs[opcode_x] = vm->regs[opcode_x] & vm->regs[opcode_y];
+#if CHIP8_QUIRK_VF_RESET
+                    vm->regs[15] = 0;
+#endif
                     break;
                 }
                 case 3: // XOR Vx, Vy (0x8xy3)
                 {
-                    chip8_log("XOR V%c, V%c", chip8__to_hex(opcode_x), chip8__to_hex(opcode_y));
                     // Set Vx = Vx XOR Vy.
                     // Performs a bitwise exclusive OR
                     // on the values of Vx and Vy,
@@ -304,11 +920,13 @@ chip8_u8 chip8_cycle(struct chip8* vm, const chip8_u8* input)
                     // then the corresponding bit in the
                     // result is set to 1. Otherwise, it is 0.
                     vm->regs[opcode_x] = vm->regs[opcode_x] ^ vm->regs[opcode_y];
+#if CHIP8_QUIRK_VF_RESET
+                    vm->regs[15] = 0;
+#endif
                     break;
                 }
                 case 4: // ADD Vx, Vy (0x8xy4)
                 {
-                    chip8_log("ADD V%c, V%c", chip8__to_hex(opcode_x), chip8__to_hex(opcode_y));
                     // Set Vx = Vx + Vy, set VF = carry.
                     // The values of Vx and Vy are added
                     // together. If the result is greater
@@ -316,62 +934,70 @@ chip8_u8 chip8_cycle(struct chip8* vm, const chip8_u8* input)
                     // to 1, otherwise 0. Only the lowest
                     // 8 bits of the result are kept,
                     // and stored in Vx.
+                    // VF is written last, so for
+                    // x = F the flag wins (all ALU ops).
                     chip8_u16 temp = (chip8_u16)vm->regs[opcode_x] + (chip8_u16)vm->regs[opcode_y];
-                    if(temp > 255) { vm->regs[15] = 1; temp = temp - 256; }
-                    else vm->regs[15] = 0;                     
                     vm->regs[opcode_x] = (chip8_u8)temp;
+                    vm->regs[15] = temp > 255;
                     break;
                 }
                 case 5: // SUB Vx, Vy (0x8xy5)
                 {
-                    chip8_log("SUB V%c, V%c", chip8__to_hex(opcode_x), chip8__to_hex(opcode_y));
                     // Set Vx = Vx - Vy, set VF = NOT borrow.
                     // If Vx > Vy, then VF is set to 1,
                     // otherwise 0. Then Vy is subtracted
                     // from Vx, and the results stored in Vx.
-                    vm->regs[opcode_x] = vm->regs[opcode_x] - vm->regs[opcode_y];
-                    if(vm->regs[opcode_x] > vm->regs[opcode_y]) vm->regs[15] = 1;
-                    else vm->regs[15] = 0;
+                    // (No borrow also covers Vx = Vy.)
+                    chip8_u8 vx = vm->regs[opcode_x], vy = vm->regs[opcode_y];
+                    vm->regs[opcode_x] = vx - vy;
+                    vm->regs[15] = vx >= vy;
                     break;
                 }
                 case 6: // SHR Vx, Vy (0x8xy6)
                 {
-                    chip8_log("SHR V%c, V%c", chip8__to_hex(opcode_x), chip8__to_hex(opcode_y));
                     // Set Vx = Vx SHR 1.
                     // If the least-significant bit of Vx
                     // is 1, then VF is set to 1, otherwise 0.
                     // Then Vx is divided by 2.
-                    if(vm->regs[opcode_x] & 0b00000001) vm->regs[15] = 1;
-                    else vm->regs[15] = 0;
+                    // (The COSMAC VIP shifts Vy instead.)
+#if CHIP8_QUIRK_SHIFT_VY
+                    chip8_u8 value = vm->regs[opcode_y];
+#else
+                    chip8_u8 value = vm->regs[opcode_x];
+#endif
+                    vm->regs[opcode_x] = value >> 1;
+                    vm->regs[15] = value & 0b00000001;
                     break;
                 }
                 case 7: // SUBN Vx, Vy (0x8xy7)
                 {
-                    chip8_log("SUBN V%c, V%c", chip8__to_hex(opcode_x), chip8__to_hex(opcode_y));
                     // Set Vx = Vy - Vx, set VF = NOT borrow.
                     // If Vy > Vx, then VF is set to 1,
                     // otherwise 0. Then Vx is subtracted
                     // from Vy, and the results stored in Vx.
-                    vm->regs[opcode_x] = vm->regs[opcode_x] - vm->regs[opcode_y];
-                    if(vm->regs[opcode_x] < vm->regs[opcode_y]) vm->regs[15] = 1;
-                    else vm->regs[15] = 0;
+                    chip8_u8 vx = vm->regs[opcode_x], vy = vm->regs[opcode_y];
+                    vm->regs[opcode_x] = vy - vx;
+                    vm->regs[15] = vy >= vx;
                     break;
                 }
                 case 14: // SHL Vx, Vy (0x8xyE)
                 {
-                    chip8_log("SHL V%c, V%c", chip8__to_hex(opcode_x), chip8__to_hex(opcode_y));
                     // Set Vx = Vx SHL 1.
                     // If the most-significant bit of
                     // Vx is 1, then VF is set to 1,
                     // otherwise to 0. Then Vx is multiplied
                     // by 2.               
-                    if(vm->regs[opcode_x] & 0b10000000) vm->regs[15] = 1;
-                    else vm->regs[15] = 0;
+#if CHIP8_QUIRK_SHIFT_VY
+                    chip8_u8 value = vm->regs[opcode_y];
+#else
+                    chip8_u8 value = vm->regs[opcode_x];
+#endif
+                    vm->regs[opcode_x] = value << 1;
+                    vm->regs[15] = value >> 7;
                     break;
                 }
                 default:
                 {
-                    chip8_log("; Unknown Instruction 0xE%c%c%c \n", chip8__to_hex(opcode_x), chip8__to_hex(opcode_y), chip8__to_hex(opcode_n));
                     //return false;
                 }
             }
@@ -379,7 +1005,6 @@ chip8_u8 chip8_cycle(struct chip8* vm, const chip8_u8* input)
         }
         case 9: // SNE Vx, Vy (0x9xy0)
         {
-            chip8_log("SE V%c, V%c \n", chip8__to_hex(opcode_x), chip8__to_hex(opcode_y));
             // Skip next instruction if Vx != Vy.
             // The values of Vx and Vy are compared,
             // and if they are not equal, the
@@ -389,7 +1014,6 @@ chip8_u8 chip8_cycle(struct chip8* vm, const chip8_u8* input)
         }
         case 10: // LD I, addr (0xAnnn)
         {
-            chip8_log("LD I, %d \n", opcode_nnn);
             // Set I = nnn.
             // The value of register I is set to nnn.
             vm->I = opcode_nnn;
@@ -397,16 +1021,19 @@ chip8_u8 chip8_cycle(struct chip8* vm, const chip8_u8* input)
         }
         case 11: // JP V0, addr (0xBnnn)
         {
-            chip8_log("JP V0, %d \n", opcode_nnn);
             // Jump to location nnn + V0.
             // The program counter is set
             // to nnn plus the value of V0
+            // (of Vx on the SUPER-CHIP).
+#if CHIP8_QUIRK_JUMP_VX
+            vm->PC = vm->regs[opcode_x] + opcode_nnn;
+#else
             vm->PC = vm->regs[0] + opcode_nnn;
+#endif
             break;
         }
         case 12: // RND Vx, byte (0xCxnn)
         {
-            chip8_log("RND V%c, %d \n", chip8__to_hex(opcode_x), opcode_nn);
             // Set Vx = random byte AND nn.
             // The interpreter generates a
             // random number from 0 to 255,
@@ -414,12 +1041,11 @@ chip8_u8 chip8_cycle(struct chip8* vm, const chip8_u8* input)
             // value nn. The results are stored
             // in Vx. See instruction 8xy2
             // for more information on AND.
-            vm->regs[opcode_x] = (chip8_u8)(rand() % 255) & opcode_nn;
+            vm->regs[opcode_x] = chip8__random(vm) & opcode_nn;
             break;
         }
         case 13: // DRW Vx, Vy, nibble (0xDxyn)
         {
-            chip8_log("DRW V%c, V%c, %d \n", chip8__to_hex(opcode_x), chip8__to_hex(opcode_y), opcode_n);
             // Display n-byte sprite starting at memory
             // location I at (Vx, Vy), set VF = collision.
             // The interpreter reads n bytes from memory,
@@ -432,33 +1058,13 @@ chip8_u8 chip8_cycle(struct chip8* vm, const chip8_u8* input)
             // If the sprite is positioned so part of it
             // is outside the coordinates of the display,
             // it wraps around to the opposite side of the screen.
-
-            chip8_u8 x_loc = vm->regs[opcode_x];
-            chip8_u8 y_loc = vm->regs[opcode_y];
-            chip8_u8 height = opcode_n;
-            chip8_u8 pixel = 0;
-            vm->regs[15] = 0;
-            for(chip8_u16 y = 0 ; y < height ; y++)
-            {
-                pixel = vm->memory[vm->I + y];
-                for(chip8_u16 x = 0 ; x < 8 ; x++ )
-                {
-                    if((pixel & (0x80 >> x)) != 0)
-                    {
-                        chip8_u16 yf = (y_loc + y) % 32;
-                        chip8_u16 xf = (x_loc + x) % 64;
-                        if(vm->display[yf * 64 + xf] == 1) vm->regs[15] = 1;
-                        vm->display[yf * 64 + xf] ^= 1;
-                    }
-                }
-            }
-            break;
+            chip8__draw(vm, vm->regs[opcode_x], vm->regs[opcode_y], opcode_n);
+            return CHIP8_EXIT_DISPLAY;
         }
         case 14: // E
         {
             if(opcode_n == 14) // SKP Vx (0xEx9E)
             {
-                chip8_log("SKP V%c \n", chip8__to_hex(opcode_x));
                 // Skip next instruction if key
                 // with the value of Vx is pressed.
                 // Checks the keyboard, and if the key
@@ -470,7 +1076,6 @@ chip8_u8 chip8_cycle(struct chip8* vm, const chip8_u8* input)
             }
             else if(opcode_n == 1) // SKNP Vx (0xExA1)
             {
-                chip8_log("SKNP V%c \n", chip8__to_hex(opcode_x));
                 // Skip next instruction if key with
                 // the value of Vx is not pressed.
                 // Checks the keyboard, and if the key
@@ -482,7 +1087,6 @@ chip8_u8 chip8_cycle(struct chip8* vm, const chip8_u8* input)
             }
             else
             {
-                chip8_log("; Unknown Instruction 0xE%c%c%c \n", chip8__to_hex(opcode_x), chip8__to_hex(opcode_y), chip8__to_hex(opcode_n));
                // return false;
             }
             break;
@@ -491,39 +1095,38 @@ chip8_u8 chip8_cycle(struct chip8* vm, const chip8_u8* input)
         {
             if(opcode_n == 7) // LD Vx, DT (0xFx07)
             {
-                chip8_log("LD V%c, DT\n", chip8__to_hex(opcode_x));
                 // Set Vx = delay timer value.
                 // The value of DT is placed into Vx.
                 vm->regs[opcode_x] = vm->DT;
             }
             else if(opcode_n == 10) // LD Vx, K (0xFx0A)
             {
-                chip8_log("LD V%c, K\n", chip8__to_hex(opcode_x));
                 // Wait for a key press, store
                 // the value of the key in Vx.
                 // All execution stops until a
                 // key is pressed, then the value
                 // of that key is stored in Vx.
                 
-                if(input[vm->regs[opcode_x]]) vm->PC -= 2;
+                if(chip8__wait_key(vm, opcode_x, input) == CHIP8_EXIT_KEY_WAIT)
+                {
+                    vm->PC -= 2;
+                    return CHIP8_EXIT_KEY_WAIT;
+                }
             }
             else if(opcode_y == 1 && opcode_n == 5) // LD DT, Vx (0xFx15)
             {
-                chip8_log("LD DT, V%c\n", chip8__to_hex(opcode_x));
                 // Set delay timer = Vx.
                 // DT is set equal to the value of Vx.
                 vm->DT = vm->regs[opcode_x];
             }
             else if(opcode_n == 8) // LD ST, Vx (0xFx18)
             {
-                chip8_log("LD ST, V%c\n", chip8__to_hex(opcode_x));
                 // Set sound timer = Vx.
                 // ST is set equal to the value of Vx.
                 vm->ST = vm->regs[opcode_x];
             }
             else if(opcode_n == 14) // ADD I, Vx (0xFx1E)
             {
-                chip8_log("ADD I, V%c\n", chip8__to_hex(opcode_x));
                 // Set I = I + Vx.
                 // The values of I and Vx are
                 // added, and the results are
@@ -532,7 +1135,6 @@ chip8_u8 chip8_cycle(struct chip8* vm, const chip8_u8* input)
             }
             else if(opcode_n == 9) // LD F, Vx (0xFx29)
             {
-                chip8_log("LD F, V%c\n", chip8__to_hex(opcode_x));
                 // Set I = location of sprite for digit Vx.
                 // The value of I is set to the location
                 // for the hexadecimal sprite corresponding
@@ -541,7 +1143,6 @@ chip8_u8 chip8_cycle(struct chip8* vm, const chip8_u8* input)
             }
             else if(opcode_n == 3) // LD B, Vx (0xFx33)
             {
-                chip8_log("LD B, V%c\n", chip8__to_hex(opcode_x));
                 // Store BCD representation of Vx
                 // in memory locations I, I+1, and I+2.
                 // The interpreter takes the decimal
@@ -553,47 +1154,1643 @@ chip8_u8 chip8_cycle(struct chip8* vm, const chip8_u8* input)
                 chip8_u8 ones_digit = temp % 10; temp /= 10;
                 chip8_u8 tens_digit = temp % 10; temp /= 10;
                 chip8_u8 hund_digit = temp % 10;
-                vm->memory[vm->I + 0] = hund_digit;
-                vm->memory[vm->I + 1] = tens_digit;
-                vm->memory[vm->I + 2] = ones_digit;
+                CHIP8__AT_I(vm, 0) = hund_digit;
+                CHIP8__AT_I(vm, 1) = tens_digit;
+                CHIP8__AT_I(vm, 2) = ones_digit;
+                chip8_invalidate(vm, vm->I, 3);
             }
             else if(opcode_y == 5 && opcode_n == 5) // LD [I], Vx (0xFx55)
             {
-                chip8_log("LD [I], V%c\n", chip8__to_hex(opcode_x));
                 // Store registers V0 through Vx
                 // in memory starting at location I.
                 // The interpreter copies the values
                 // of registers V0 through Vx into
                 // memory, starting at the address in I.
-                chip8__memcpy(vm->memory + vm->I, vm->regs, opcode_x);
+                chip8__store_regs(vm, opcode_x + 1);
+#if CHIP8_QUIRK_LOAD_STORE_I
+                vm->I += opcode_x + 1;
+#endif
             }
             else if(opcode_y == 6 && opcode_n == 5) // LD Vx, [I] (0xFx65)
             {
-                chip8_log("LD V%c, [I]\n", chip8__to_hex(opcode_x));
                 // Read registers V0 through Vx
                 // from memory starting at location I.
                 // The interpreter reads values from
                 // memory starting at location I
                 // into registers V0 through Vx.
-                chip8__memcpy(vm->regs, vm->memory + vm->I, opcode_x);                
+                chip8__load_regs(vm, opcode_x + 1);
+#if CHIP8_QUIRK_LOAD_STORE_I
+                vm->I += opcode_x + 1;
+#endif
             }            
             else
             {
-                chip8_log("; Unknown Instruction 0xE%c%c%c \n", chip8__to_hex(opcode_x), chip8__to_hex(opcode_y), chip8__to_hex(opcode_n));
                 //return false;
             }
             break;
         }
         default:
         {
-            chip8_log("; Unknown Instruction 0xE%c%c%c \n", chip8__to_hex(opcode_x), chip8__to_hex(opcode_y), chip8__to_hex(opcode_n));
             //return false;
         }
     }
+    return CHIP8_EXIT_NONE;
+}
+
+chip8_u8 chip8_cycle_switch(struct chip8* vm, const chip8_u8* input)
+{
+    chip8_u8 reason = chip8__step_switch(vm, input);
+    vm->cycles++;
+    if(reason == CHIP8__EXIT_IDLE) return true;
+    if(CHIP8_EXIT_IS_FATAL(reason)) return false;
     if(vm->PC >= 4096) return false;
     return true;
 }
 
+// Shared batch loop of the switch and predecoded cores.
+static chip8_u8 chip8__run(struct chip8* vm, const chip8_u8* input, chip8_u32 max_cycles, chip8_u8 predecoded);
+
+chip8_u8 chip8_run_switch(struct chip8* vm, const chip8_u8* input, chip8_u32 max_cycles)
+{
+    return chip8__run(vm, input, max_cycles, false);
+}
+
+// predecoded core
+//
+// Every even address has a slot in vm->decoded holding the
+// instruction found there already pulled apart into its
+// operation kind and operands. Slots are filled the first
+// time the instruction is run and thrown away whenever the
+// VM writes to the bytes they were decoded from (FX33, FX55)
+// or a ROM is (re)loaded. The semantics of every handler
+// below match the corresponding case of chip8_cycle_switch exactly.
+
+static void chip8__decode_opcode(chip8_u16 opcode, struct chip8_insn* insn)
+{
+    chip8_u8 opcode_s = (chip8_u8)(opcode >> 12);
+    chip8_u8 x = (chip8_u8)((opcode >> 8) & 0b00001111);
+    chip8_u8 y = (chip8_u8)((opcode >> 4) & 0b00001111);
+    chip8_u8 n = (chip8_u8)(opcode & 0b00001111);
+    insn->x = x;
+    insn->y = y;
+    insn->nn = (chip8_u8)opcode;
+    switch(opcode_s)
+    {
+        case 0:
+        {
+            if(x == 0 && y == 0 && n == 0) insn->op = CHIP8_OP_HALT;
+            else if(y == 14 && n == 0) insn->op = CHIP8_OP_CLS;
+            else if(y == 14 && n == 14) insn->op = CHIP8_OP_RET;
+            else insn->op = CHIP8_OP_SYS;
+            break;
+        }
+        case 1: insn->op = CHIP8_OP_JP; break;
+        case 2: insn->op = CHIP8_OP_CALL; break;
+        case 3: insn->op = CHIP8_OP_SE_VX_NN; break;
+        case 4: insn->op = CHIP8_OP_SNE_VX_NN; break;
+        case 5: insn->op = CHIP8_OP_SE_VX_VY; break;
+        case 6: insn->op = CHIP8_OP_LD_VX_NN; break;
+        case 7: insn->op = CHIP8_OP_ADD_VX_NN; break;
+        case 8:
+        {
+            switch(n)
+            {
+                case 0: insn->op = CHIP8_OP_LD_VX_VY; break;
+                case 1: insn->op = CHIP8_OP_OR; break;
+                case 2: insn->op = CHIP8_OP_AND; break;
+                case 3: insn->op = CHIP8_OP_XOR; break;
+                case 4: insn->op = CHIP8_OP_ADD_VX_VY; break;
+                case 5: insn->op = CHIP8_OP_SUB; break;
+                case 6: insn->op = CHIP8_OP_SHR; break;
+                case 7: insn->op = CHIP8_OP_SUBN; break;
+                case 14: insn->op = CHIP8_OP_SHL; break;
+                default: insn->op = CHIP8_OP_UNKNOWN; break;
+            }
+            break;
+        }
+        case 9: insn->op = CHIP8_OP_SNE_VX_VY; break;
+        case 10: insn->op = CHIP8_OP_LD_I_NNN; break;
+        case 11: insn->op = CHIP8_OP_JP_V0; break;
+        case 12: insn->op = CHIP8_OP_RND; break;
+        case 13: insn->op = CHIP8_OP_DRW; break;
+        case 14:
+        {
+            if(n == 14) insn->op = CHIP8_OP_SKP;
+            else if(n == 1) insn->op = CHIP8_OP_SKNP;
+            else insn->op = CHIP8_OP_UNKNOWN;
+            break;
+        }
+        case 15:
+        {
+            if(n == 7) insn->op = CHIP8_OP_LD_VX_DT;
+            else if(n == 10) insn->op = CHIP8_OP_LD_VX_K;
+            else if(y == 1 && n == 5) insn->op = CHIP8_OP_LD_DT_VX;
+            else if(n == 8) insn->op = CHIP8_OP_LD_ST_VX;
+            else if(n == 14) insn->op = CHIP8_OP_ADD_I_VX;
+            else if(n == 9) insn->op = CHIP8_OP_LD_F_VX;
+            else if(n == 3) insn->op = CHIP8_OP_LD_B_VX;
+            else if(y == 5 && n == 5) insn->op = CHIP8_OP_LD_MEM_VX;
+            else if(y == 6 && n == 5) insn->op = CHIP8_OP_LD_VX_MEM;
+            else insn->op = CHIP8_OP_UNKNOWN;
+            break;
+        }
+    }
+}
+
+// the opcode at address, the second byte of one at 0xFFF
+// wraps around to 0
+#define CHIP8__OPCODE_AT(memory, address) ((chip8_u16)(((memory)[(address) & 0xFFF] << 8) | (memory)[((address) + 1) & 0xFFF]))
+
+static void chip8__decode(const struct chip8* vm, chip8_u16 address, struct chip8_insn* insn)
+{
+    chip8__decode_opcode(CHIP8__OPCODE_AT(vm->memory, address), insn);
+}
+
+// Assembly syntax of every operation, after Cowgod's
+// reference: %x and %y are the register digits, %n the
+// nibble, %b the byte, %a the address and %w the whole
+// opcode.
+static const char* const chip8__op_syntax[CHIP8_OP_COUNT] =
+{
+    [CHIP8_OP_UNDECODED] = "",
+    [CHIP8_OP_HALT] = "HALT",
+    [CHIP8_OP_CLS] = "CLS",
+    [CHIP8_OP_RET] = "RET",
+    [CHIP8_OP_SYS] = "SYS 0x%a",
+    [CHIP8_OP_JP] = "JP 0x%a",
+    [CHIP8_OP_CALL] = "CALL 0x%a",
+    [CHIP8_OP_SE_VX_NN] = "SE V%x, 0x%b",
+    [CHIP8_OP_SNE_VX_NN] = "SNE V%x, 0x%b",
+    [CHIP8_OP_SE_VX_VY] = "SE V%x, V%y",
+    [CHIP8_OP_LD_VX_NN] = "LD V%x, 0x%b",
+    [CHIP8_OP_ADD_VX_NN] = "ADD V%x, 0x%b",
+    [CHIP8_OP_LD_VX_VY] = "LD V%x, V%y",
+    [CHIP8_OP_OR] = "OR V%x, V%y",
+    [CHIP8_OP_AND] = "AND V%x, V%y",
+    [CHIP8_OP_XOR] = "XOR V%x, V%y",
+    [CHIP8_OP_ADD_VX_VY] = "ADD V%x, V%y",
+    [CHIP8_OP_SUB] = "SUB V%x, V%y",
+    [CHIP8_OP_SHR] = "SHR V%x, V%y",
+    [CHIP8_OP_SUBN] = "SUBN V%x, V%y",
+    [CHIP8_OP_SHL] = "SHL V%x, V%y",
+    [CHIP8_OP_SNE_VX_VY] = "SNE V%x, V%y",
+    [CHIP8_OP_LD_I_NNN] = "LD I, 0x%a",
+#if CHIP8_QUIRK_JUMP_VX
+    [CHIP8_OP_JP_V0] = "JP V%x, 0x%a",
+#else
+    [CHIP8_OP_JP_V0] = "JP V0, 0x%a",
+#endif
+    [CHIP8_OP_RND] = "RND V%x, 0x%b",
+    [CHIP8_OP_DRW] = "DRW V%x, V%y, %n",
+    [CHIP8_OP_SKP] = "SKP V%x",
+    [CHIP8_OP_SKNP] = "SKNP V%x",
+    [CHIP8_OP_LD_VX_DT] = "LD V%x, DT",
+    [CHIP8_OP_LD_VX_K] = "LD V%x, K",
+    [CHIP8_OP_LD_DT_VX] = "LD DT, V%x",
+    [CHIP8_OP_LD_ST_VX] = "LD ST, V%x",
+    [CHIP8_OP_ADD_I_VX] = "ADD I, V%x",
+    [CHIP8_OP_LD_F_VX] = "LD F, V%x",
+    [CHIP8_OP_LD_B_VX] = "LD B, V%x",
+    [CHIP8_OP_LD_MEM_VX] = "LD [I], V%x",
+    [CHIP8_OP_LD_VX_MEM] = "LD V%x, [I]",
+    [CHIP8_OP_UNKNOWN] = "DW 0x%w",
+};
+
+// Writes the syntax of an opcode at out (no terminator)
+// and returns the end.
+static char* chip8__disassemble_opcode(chip8_u16 opcode, char* out)
+{
+    struct chip8_insn insn;
+    chip8__decode_opcode(opcode, &insn);
+    for(const char* syntax = chip8__op_syntax[insn.op] ; *syntax ; syntax++)
+    {
+        if(*syntax != '%') { *out++ = *syntax; continue; }
+        switch(*++syntax)
+        {
+            case 'x': out = chip8__put_hex(out, insn.x, 1); break;
+            case 'y': out = chip8__put_hex(out, insn.y, 1); break;
+            case 'n': out = chip8__put_hex(out, CHIP8_INSN_N(&insn), 1); break;
+            case 'b': out = chip8__put_hex(out, insn.nn, 2); break;
+            case 'a': out = chip8__put_hex(out, CHIP8_INSN_NNN(&insn), 3); break;
+            case 'w': out = chip8__put_hex(out, opcode, 4); break;
+        }
+    }
+    return out;
+}
+
+// Writes the instruction in the two bytes at
+// memory + address (wrapping at 4 KB like the cores, so
+// the one at 0xFFF ends in memory[0]) as assembly, e.g.
+// "LD V3, 0x1F", into a
+// buffer of at least CHIP8_DISASSEMBLY_SIZE chars and
+// returns its length. Nothing is formatted before it is
+// asked for, so a debugger only pays for the lines it
+// shows.
+int chip8_disassemble(const chip8_u8* memory, chip8_u16 address, char* buffer)
+{
+    char* end = chip8__disassemble_opcode(CHIP8__OPCODE_AT(memory, address), buffer);
+    *end = '\0';
+    return (int)(end - buffer);
+}
+
+// Disassembles every instruction from start up to end
+// (e.g. a whole ROM from 0x200), one "200: 6005  LD V0, 0x05"
+// line each, into buffer. Only whole lines are written,
+// (end - start) / 2 * CHIP8_DISASSEMBLY_LINE_SIZE + 1 chars
+// always hold them all. Returns the length written.
+chip8_u32 chip8_disassemble_range(const chip8_u8* memory, chip8_u16 start, chip8_u16 end, char* buffer, chip8_u32 size)
+{
+    chip8_u32 length = 0;
+    for(chip8_u32 address = start ; address + 1 < end ; address += 2)
+    {
+        if(size - length < CHIP8_DISASSEMBLY_LINE_SIZE + 1) break;
+        char* out = buffer + length;
+        out = chip8__put_hex(out, (chip8_u16)address, 3);
+        out = chip8__put_text(out, ": ");
+        out = chip8__put_hex(out, CHIP8__OPCODE_AT(memory, address), 4);
+        out = chip8__put_text(out, "  ");
+        out += chip8_disassemble(memory, (chip8_u16)address, out);
+        *out++ = '\n';
+        length = (chip8_u32)(out - buffer);
+    }
+    if(size > length) buffer[length] = '\0';
+    return length;
+}
+
+// Returns the predecoded instruction at PC, decoding it
+// into its slot if needed. Instructions at odd addresses
+// have no slot and are decoded into scratch instead.
+static const struct chip8_insn* chip8__fetch(struct chip8* vm, struct chip8_insn* scratch)
+{
+    if(vm->PC & 1)
+    {
+        chip8__decode(vm, vm->PC, scratch);
+        return scratch;
+    }
+    struct chip8_insn* insn = &vm->decoded[vm->PC >> 1];
+    if(insn->op == CHIP8_OP_UNDECODED) chip8__decode(vm, vm->PC, insn);
+    return insn;
+}
+
+static chip8_u8 chip8__op_halt(struct chip8* vm, const struct chip8_insn* insn, const chip8_u8* input)
+{
+    (void)vm; (void)insn; (void)input;
+    return CHIP8_EXIT_HALT;
+}
+
+static chip8_u8 chip8__op_cls(struct chip8* vm, const struct chip8_insn* insn, const chip8_u8* input)
+{
+    (void)insn; (void)input;
+    vm->PC += 2;
+    chip8__clear_display(vm);
+    return CHIP8_EXIT_DISPLAY;
+}
+
+static chip8_u8 chip8__op_ret(struct chip8* vm, const struct chip8_insn* insn, const chip8_u8* input)
+{
+    (void)insn; (void)input;
+    vm->PC += 2;
+    if(vm->SP == 0) return CHIP8_EXIT_STACK_UNDERFLOW;
+    vm->SP -= 1;
+    vm->PC = vm->stack[vm->SP];
+    return CHIP8_EXIT_NONE;
+}
+
+static chip8_u8 chip8__op_sys(struct chip8* vm, const struct chip8_insn* insn, const chip8_u8* input)
+{
+    (void)insn; (void)input;
+    vm->PC += 2;
+    return CHIP8_EXIT_NONE;
+}
+
+static chip8_u8 chip8__op_jp(struct chip8* vm, const struct chip8_insn* insn, const chip8_u8* input)
+{
+    chip8_u16 from = vm->PC;
+    vm->PC = CHIP8_INSN_NNN(insn);
+    if(CHIP8_INSN_NNN(insn) <= from && chip8__idle_length(vm, input)) return CHIP8__EXIT_IDLE;
+    return CHIP8_EXIT_NONE;
+}
+
+static chip8_u8 chip8__op_call(struct chip8* vm, const struct chip8_insn* insn, const chip8_u8* input)
+{
+    (void)input;
+    vm->PC += 2;
+    if(vm->SP == 16) return CHIP8_EXIT_STACK_OVERFLOW;
+    vm->stack[vm->SP] = vm->PC;
+    vm->SP += 1;
+    vm->PC = CHIP8_INSN_NNN(insn);
+    return CHIP8_EXIT_NONE;
+}
+
+static chip8_u8 chip8__op_se_vx_nn(struct chip8* vm, const struct chip8_insn* insn, const chip8_u8* input)
+{
+    (void)input;
+    vm->PC += (vm->regs[insn->x] == insn->nn) ? 4 : 2;
+    return CHIP8_EXIT_NONE;
+}
+
+static chip8_u8 chip8__op_sne_vx_nn(struct chip8* vm, const struct chip8_insn* insn, const chip8_u8* input)
+{
+    (void)input;
+    vm->PC += (vm->regs[insn->x] != insn->nn) ? 4 : 2;
+    return CHIP8_EXIT_NONE;
+}
+
+static chip8_u8 chip8__op_se_vx_vy(struct chip8* vm, const struct chip8_insn* insn, const chip8_u8* input)
+{
+    (void)input;
+    vm->PC += (vm->regs[insn->x] == vm->regs[insn->y]) ? 4 : 2;
+    return CHIP8_EXIT_NONE;
+}
+
+static chip8_u8 chip8__op_ld_vx_nn(struct chip8* vm, const struct chip8_insn* insn, const chip8_u8* input)
+{
+    (void)input;
+    vm->PC += 2;
+    vm->regs[insn->x] = insn->nn;
+    return CHIP8_EXIT_NONE;
+}
+
+static chip8_u8 chip8__op_add_vx_nn(struct chip8* vm, const struct chip8_insn* insn, const chip8_u8* input)
+{
+    (void)input;
+    vm->PC += 2;
+    vm->regs[insn->x] = (chip8_u8)(vm->regs[insn->x] + insn->nn);
+    return CHIP8_EXIT_NONE;
+}
+
+static chip8_u8 chip8__op_ld_vx_vy(struct chip8* vm, const struct chip8_insn* insn, const chip8_u8* input)
+{
+    (void)input;
+    vm->PC += 2;
+    vm->regs[insn->x] = vm->regs[insn->y];
+    return CHIP8_EXIT_NONE;
+}
+
+// the value 8XY6/8XYE shift
+#if CHIP8_QUIRK_SHIFT_VY
+#define CHIP8__SHIFT_SOURCE(vm, insn) ((vm)->regs[(insn)->y])
+#else
+#define CHIP8__SHIFT_SOURCE(vm, insn) ((vm)->regs[(insn)->x])
+#endif
+
+static chip8_u8 chip8__op_or(struct chip8* vm, const struct chip8_insn* insn, const chip8_u8* input)
+{
+    (void)input;
+    vm->PC += 2;
+    vm->regs[insn->x] = vm->regs[insn->x] | vm->regs[insn->y];
+#if CHIP8_QUIRK_VF_RESET
+    vm->regs[15] = 0;
+#endif
+    return CHIP8_EXIT_NONE;
+}
+
+static chip8_u8 chip8__op_and(struct chip8* vm, const struct chip8_insn* insn, const chip8_u8* input)
+{
+    (void)input;
+    vm->PC += 2;
+    vm->regs[insn->x] = vm->regs[insn->x] & vm->regs[insn->y];
+#if CHIP8_QUIRK_VF_RESET
+    vm->regs[15] = 0;
+#endif
+    return CHIP8_EXIT_NONE;
+}
+
+static chip8_u8 chip8__op_xor(struct chip8* vm, const struct chip8_insn* insn, const chip8_u8* input)
+{
+    (void)input;
+    vm->PC += 2;
+    vm->regs[insn->x] = vm->regs[insn->x] ^ vm->regs[insn->y];
+#if CHIP8_QUIRK_VF_RESET
+    vm->regs[15] = 0;
+#endif
+    return CHIP8_EXIT_NONE;
+}
+
+static chip8_u8 chip8__op_add_vx_vy(struct chip8* vm, const struct chip8_insn* insn, const chip8_u8* input)
+{
+    (void)input;
+    vm->PC += 2;
+    chip8_u16 temp = (chip8_u16)vm->regs[insn->x] + (chip8_u16)vm->regs[insn->y];
+    vm->regs[insn->x] = (chip8_u8)temp;
+    vm->regs[15] = temp > 255;
+    return CHIP8_EXIT_NONE;
+}
+
+static chip8_u8 chip8__op_sub(struct chip8* vm, const struct chip8_insn* insn, const chip8_u8* input)
+{
+    (void)input;
+    vm->PC += 2;
+    chip8_u8 vx = vm->regs[insn->x], vy = vm->regs[insn->y];
+    vm->regs[insn->x] = vx - vy;
+    vm->regs[15] = vx >= vy;
+    return CHIP8_EXIT_NONE;
+}
+
+static chip8_u8 chip8__op_shr(struct chip8* vm, const struct chip8_insn* insn, const chip8_u8* input)
+{
+    (void)input;
+    vm->PC += 2;
+    chip8_u8 value = CHIP8__SHIFT_SOURCE(vm, insn);
+    vm->regs[insn->x] = value >> 1;
+    vm->regs[15] = value & 0b00000001;
+    return CHIP8_EXIT_NONE;
+}
+
+static chip8_u8 chip8__op_subn(struct chip8* vm, const struct chip8_insn* insn, const chip8_u8* input)
+{
+    (void)input;
+    vm->PC += 2;
+    chip8_u8 vx = vm->regs[insn->x], vy = vm->regs[insn->y];
+    vm->regs[insn->x] = vy - vx;
+    vm->regs[15] = vy >= vx;
+    return CHIP8_EXIT_NONE;
+}
+
+static chip8_u8 chip8__op_shl(struct chip8* vm, const struct chip8_insn* insn, const chip8_u8* input)
+{
+    (void)input;
+    vm->PC += 2;
+    chip8_u8 value = CHIP8__SHIFT_SOURCE(vm, insn);
+    vm->regs[insn->x] = value << 1;
+    vm->regs[15] = value >> 7;
+    return CHIP8_EXIT_NONE;
+}
+
+static chip8_u8 chip8__op_sne_vx_vy(struct chip8* vm, const struct chip8_insn* insn, const chip8_u8* input)
+{
+    (void)input;
+    vm->PC += (vm->regs[insn->x] != vm->regs[insn->y]) ? 4 : 2;
+    return CHIP8_EXIT_NONE;
+}
+
+static chip8_u8 chip8__op_ld_i_nnn(struct chip8* vm, const struct chip8_insn* insn, const chip8_u8* input)
+{
+    (void)input;
+    vm->PC += 2;
+    vm->I = CHIP8_INSN_NNN(insn);
+    return CHIP8_EXIT_NONE;
+}
+
+static chip8_u8 chip8__op_jp_v0(struct chip8* vm, const struct chip8_insn* insn, const chip8_u8* input)
+{
+    (void)input;
+#if CHIP8_QUIRK_JUMP_VX
+    vm->PC = vm->regs[insn->x] + CHIP8_INSN_NNN(insn);
+#else
+    vm->PC = vm->regs[0] + CHIP8_INSN_NNN(insn);
+#endif
+    return CHIP8_EXIT_NONE;
+}
+
+static chip8_u8 chip8__op_rnd(struct chip8* vm, const struct chip8_insn* insn, const chip8_u8* input)
+{
+    (void)input;
+    vm->PC += 2;
+    vm->regs[insn->x] = chip8__random(vm) & insn->nn;
+    return CHIP8_EXIT_NONE;
+}
+
+static chip8_u8 chip8__op_drw(struct chip8* vm, const struct chip8_insn* insn, const chip8_u8* input)
+{
+    (void)input;
+    vm->PC += 2;
+    chip8__draw(vm, vm->regs[insn->x], vm->regs[insn->y], CHIP8_INSN_N(insn));
+    return CHIP8_EXIT_DISPLAY;
+}
+
+static chip8_u8 chip8__op_skp(struct chip8* vm, const struct chip8_insn* insn, const chip8_u8* input)
+{
+    vm->PC += input[vm->regs[insn->x]] ? 4 : 2;
+    return CHIP8_EXIT_NONE;
+}
+
+static chip8_u8 chip8__op_sknp(struct chip8* vm, const struct chip8_insn* insn, const chip8_u8* input)
+{
+    vm->PC += input[vm->regs[insn->x]] ? 2 : 4;
+    return CHIP8_EXIT_NONE;
+}
+
+static chip8_u8 chip8__op_ld_vx_dt(struct chip8* vm, const struct chip8_insn* insn, const chip8_u8* input)
+{
+    (void)input;
+    vm->PC += 2;
+    vm->regs[insn->x] = vm->DT;
+    return CHIP8_EXIT_NONE;
+}
+
+static chip8_u8 chip8__op_ld_vx_k(struct chip8* vm, const struct chip8_insn* insn, const chip8_u8* input)
+{
+    if(chip8__wait_key(vm, insn->x, input) == CHIP8_EXIT_KEY_WAIT) return CHIP8_EXIT_KEY_WAIT;
+    vm->PC += 2;
+    return CHIP8_EXIT_NONE;
+}
+
+static chip8_u8 chip8__op_ld_dt_vx(struct chip8* vm, const struct chip8_insn* insn, const chip8_u8* input)
+{
+    (void)input;
+    vm->PC += 2;
+    vm->DT = vm->regs[insn->x];
+    return CHIP8_EXIT_NONE;
+}
+
+static chip8_u8 chip8__op_ld_st_vx(struct chip8* vm, const struct chip8_insn* insn, const chip8_u8* input)
+{
+    (void)input;
+    vm->PC += 2;
+    vm->ST = vm->regs[insn->x];
+    return CHIP8_EXIT_NONE;
+}
+
+static chip8_u8 chip8__op_add_i_vx(struct chip8* vm, const struct chip8_insn* insn, const chip8_u8* input)
+{
+    (void)input;
+    vm->PC += 2;
+    vm->I = vm->I + vm->regs[insn->x];
+    return CHIP8_EXIT_NONE;
+}
+
+static chip8_u8 chip8__op_ld_f_vx(struct chip8* vm, const struct chip8_insn* insn, const chip8_u8* input)
+{
+    (void)input;
+    vm->PC += 2;
+    vm->I = 5 * vm->regs[insn->x];
+    return CHIP8_EXIT_NONE;
+}
+
+static chip8_u8 chip8__op_ld_b_vx(struct chip8* vm, const struct chip8_insn* insn, const chip8_u8* input)
+{
+    (void)input;
+    vm->PC += 2;
+    chip8_u8 temp = vm->regs[insn->x];
+    CHIP8__AT_I(vm, 0) = temp / 100;
+    CHIP8__AT_I(vm, 1) = (temp / 10) % 10;
+    CHIP8__AT_I(vm, 2) = temp % 10;
+    chip8_invalidate(vm, vm->I, 3);
+    return CHIP8_EXIT_NONE;
+}
+
+static chip8_u8 chip8__op_ld_mem_vx(struct chip8* vm, const struct chip8_insn* insn, const chip8_u8* input)
+{
+    (void)input;
+    vm->PC += 2;
+    chip8__store_regs(vm, insn->x + 1);
+#if CHIP8_QUIRK_LOAD_STORE_I
+    vm->I += insn->x + 1;
+#endif
+    return CHIP8_EXIT_NONE;
+}
+
+static chip8_u8 chip8__op_ld_vx_mem(struct chip8* vm, const struct chip8_insn* insn, const chip8_u8* input)
+{
+    (void)input;
+    vm->PC += 2;
+    chip8__load_regs(vm, insn->x + 1);
+#if CHIP8_QUIRK_LOAD_STORE_I
+    vm->I += insn->x + 1;
+#endif
+    return CHIP8_EXIT_NONE;
+}
+
+static chip8_u8 chip8__op_unknown(struct chip8* vm, const struct chip8_insn* insn, const chip8_u8* input)
+{
+    (void)insn; (void)input;
+    vm->PC += 2;
+    return CHIP8_EXIT_NONE;
+}
+
+static chip8_u8 chip8__execute(struct chip8* vm, const struct chip8_insn* insn, const chip8_u8* input)
+{
+    switch(insn->op)
+    {
+#define CHIP8__OP_CASE(name, func) case CHIP8_OP_##name: return chip8__op_##func(vm, insn, input);
+        CHIP8__OPS(CHIP8__OP_CASE)
+#undef CHIP8__OP_CASE
+    }
+    return CHIP8_EXIT_NONE;
+}
+
+chip8_u8 chip8_cycle_predecoded(struct chip8* vm, const chip8_u8* input)
+{
+    struct chip8_insn scratch;
+    chip8_u8 reason = chip8__execute(vm, chip8__fetch(vm, &scratch), input);
+    vm->cycles++;
+    if(reason == CHIP8__EXIT_IDLE) return true;
+    if(CHIP8_EXIT_IS_FATAL(reason)) return false;
+    if(vm->PC >= 4096) return false;
+    return true;
+}
+
+chip8_u8 chip8_run_predecoded(struct chip8* vm, const chip8_u8* input, chip8_u32 max_cycles)
+{
+    return chip8__run(vm, input, max_cycles, true);
+}
+
+// chip8__run for a VM with a trace, one instruction at a
+// time on the predecoded core
+static chip8_u8 chip8__run_traced(struct chip8* vm, const chip8_u8* input, chip8_u32 max_cycles)
+{
+    struct chip8_insn scratch;
+    struct chip8_trace* trace = vm->trace;
+    chip8_u8 stop_on_display = (vm->stop_flags & CHIP8_STOP_DISPLAY) != 0;
+    chip8_u8 result = CHIP8_EXIT_NONE;
+    chip8_u32 executed = 0;
+    chip8_u8 before[16];
+    for(;;)
+    {
+        if(vm->PC >= 4096) { result = CHIP8_EXIT_PC_OUT_OF_RANGE; break; }
+        if(executed == max_cycles) break;
+        if(vm->breakpoint_count && executed > 0 && chip8__is_breakpoint(vm, vm->PC)) { result = CHIP8_EXIT_BREAKPOINT; break; }
+        executed++;
+        struct chip8_trace_entry* entry = &trace->entries[trace->count & (trace->capacity - 1)];
+        entry->PC = vm->PC;
+        entry->opcode = (vm->memory[vm->PC] << 8) | vm->memory[(vm->PC + 1) & 4095];
+        chip8__memcpy(before, vm->regs, 16);
+        chip8_u8 reason = chip8__execute(vm, chip8__fetch(vm, &scratch), input);
+        entry->I = vm->I;
+        entry->reg = CHIP8_TRACE_NO_REG;
+        for(chip8_u8 i = 0 ; i < 16 ; i++) // VF last, so it only counts when alone
+        {
+            if(vm->regs[i] != before[i] && entry->reg == CHIP8_TRACE_NO_REG) entry->reg = i;
+        }
+        if(entry->reg != CHIP8_TRACE_NO_REG) entry->value = vm->regs[entry->reg];
+        trace->count++;
+        if(reason == CHIP8__EXIT_IDLE) { executed += chip8__skip_idle(vm, input, max_cycles - executed); continue; }
+        if(reason != CHIP8_EXIT_NONE && (reason != CHIP8_EXIT_DISPLAY || stop_on_display)) { result = reason; break; }
+    }
+    vm->cycles += executed;
+    return result;
+}
+
+// A breakpoint stops the VM before the instruction at its
+// address runs, except when that is the first instruction
+// of the batch so that running again continues past it.
+static chip8_u8 chip8__run(struct chip8* vm, const chip8_u8* input, chip8_u32 max_cycles, chip8_u8 predecoded)
+{
+    if(vm->trace) return chip8__run_traced(vm, input, max_cycles);
+    struct chip8_insn scratch;
+    chip8_u8 stop_on_display = (vm->stop_flags & CHIP8_STOP_DISPLAY) != 0;
+    chip8_u8 result = CHIP8_EXIT_NONE;
+    chip8_u32 executed = 0;
+    for(;;)
+    {
+        if(vm->PC >= 4096) { result = CHIP8_EXIT_PC_OUT_OF_RANGE; break; }
+        if(executed == max_cycles) break;
+        if(vm->breakpoint_count && executed > 0 && chip8__is_breakpoint(vm, vm->PC)) { result = CHIP8_EXIT_BREAKPOINT; break; }
+        executed++;
+        chip8_u8 reason = predecoded ? chip8__execute(vm, chip8__fetch(vm, &scratch), input) : chip8__step_switch(vm, input);
+        if(reason == CHIP8__EXIT_IDLE) { executed += chip8__skip_idle(vm, input, max_cycles - executed); continue; }
+        if(reason != CHIP8_EXIT_NONE && (reason != CHIP8_EXIT_DISPLAY || stop_on_display)) { result = reason; break; }
+    }
+    vm->cycles += executed;
+    return result;
+}
+
+// threaded core
+//
+// Runs up to max_cycles instructions without returning,
+// stopping early for the same reasons as chip8_run. With
+// GCC/Clang every handler ends in its own computed goto to
+// the next one, so each dispatch branch is predicted on
+// its own instead of all of them sharing the one of a
+// switch. Other compilers go through a table of handler
+// pointers.
+
+#if defined(__GNUC__) && !defined(CHIP8_NO_COMPUTED_GOTO)
+
+chip8_u8 chip8_run_threaded(struct chip8* vm, const chip8_u8* input, chip8_u32 max_cycles)
+{
+#define CHIP8__OP_LABEL(name, func) &&chip8__label_##name,
+    static void* const labels[CHIP8_OP_COUNT] = { 0, CHIP8__OPS(CHIP8__OP_LABEL) };
+#undef CHIP8__OP_LABEL
+
+    chip8_u32 remaining = max_cycles;
+    chip8_u8 result = CHIP8_EXIT_NONE;
+    chip8_u8 stop_on_display = (vm->stop_flags & CHIP8_STOP_DISPLAY) != 0;
+    chip8_u8 check_breakpoints = vm->breakpoint_count != 0;
+    struct chip8_insn scratch;
+    const struct chip8_insn* insn;
+    if(vm->trace) return chip8__run_traced(vm, input, max_cycles);
+
+#define CHIP8__DISPATCH() \
+    do { \
+        if(vm->PC >= 4096) { result = CHIP8_EXIT_PC_OUT_OF_RANGE; goto done; } \
+        if(remaining == 0) goto done; \
+        if(check_breakpoints && remaining != max_cycles && chip8__is_breakpoint(vm, vm->PC)) { result = CHIP8_EXIT_BREAKPOINT; goto done; } \
+        remaining--; \
+        insn = chip8__fetch(vm, &scratch); \
+        goto *labels[insn->op]; \
+    } while(0)
+
+#define CHIP8__OP_BODY(name, func) \
+    chip8__label_##name: \
+    { \
+        chip8_u8 reason = chip8__op_##func(vm, insn, input); \
+        if(reason == CHIP8__EXIT_IDLE) remaining -= chip8__skip_idle(vm, input, remaining); \
+        else if(reason != CHIP8_EXIT_NONE && (reason != CHIP8_EXIT_DISPLAY || stop_on_display)) { result = reason; goto done; } \
+        CHIP8__DISPATCH(); \
+    }
+
+    CHIP8__DISPATCH();
+    CHIP8__OPS(CHIP8__OP_BODY)
+
+#undef CHIP8__OP_BODY
+#undef CHIP8__DISPATCH
+
+done:
+    vm->cycles += max_cycles - remaining;
+    return result;
+}
+
+#else
+
+typedef chip8_u8 (*chip8__handler)(struct chip8* vm, const struct chip8_insn* insn, const chip8_u8* input);
+
+#define CHIP8__OP_HANDLER(name, func) chip8__op_##func,
+static const chip8__handler chip8__handlers[CHIP8_OP_COUNT] = { 0, CHIP8__OPS(CHIP8__OP_HANDLER) };
+#undef CHIP8__OP_HANDLER
+
+chip8_u8 chip8_run_threaded(struct chip8* vm, const chip8_u8* input, chip8_u32 max_cycles)
+{
+    chip8_u32 remaining = max_cycles;
+    chip8_u8 result = CHIP8_EXIT_NONE;
+    chip8_u8 stop_on_display = (vm->stop_flags & CHIP8_STOP_DISPLAY) != 0;
+    chip8_u8 check_breakpoints = vm->breakpoint_count != 0;
+    struct chip8_insn scratch;
+    if(vm->trace) return chip8__run_traced(vm, input, max_cycles);
+    for(;;)
+    {
+        if(vm->PC >= 4096) { result = CHIP8_EXIT_PC_OUT_OF_RANGE; break; }
+        if(remaining == 0) break;
+        if(check_breakpoints && remaining != max_cycles && chip8__is_breakpoint(vm, vm->PC)) { result = CHIP8_EXIT_BREAKPOINT; break; }
+        remaining--;
+        const struct chip8_insn* insn = chip8__fetch(vm, &scratch);
+        chip8_u8 reason = chip8__handlers[insn->op](vm, insn, input);
+        if(reason == CHIP8__EXIT_IDLE) { remaining -= chip8__skip_idle(vm, input, remaining); continue; }
+        if(reason != CHIP8_EXIT_NONE && (reason != CHIP8_EXIT_DISPLAY || stop_on_display)) { result = reason; break; }
+    }
+    vm->cycles += max_cycles - remaining;
+    return result;
+}
+
+#endif
+
+#ifdef CHIP8_JIT
+
+// x86-64 JIT
+//
+// Translates the basic block starting at PC into machine
+// code the first time it is reached. Within a block every
+// guest register it touches (V0-VF and I) lives in a host
+// register: they are loaded on entry and the dirty ones
+// written back on exit. A block ends after a jump or skip,
+// before any instruction it can not translate (those run
+// on the predecoded interpreter, then translation resumes
+// at the next block), when it runs out of host registers
+// or reaches CHIP8_JIT_MAX_BLOCK instructions.
+//
+// FX33 and FX55 store straight into memory from within a
+// block, unless one of the bytes they write was translated
+// into some block or the store wraps around the end of
+// memory. Then the block leaves through a side
+// exit right before the store and chip8_run_jit runs it on
+// the interpreter, which drops the blocks it overwrites.
+//
+// The code cache is never writable and executable at once:
+// it stays read/execute and is only made read/write while
+// a block is being emitted into it.
+
+#if !defined(__x86_64__) && !defined(_M_X64)
+#error "CHIP8_JIT needs an x86-64 host"
+#endif
+
+#include <stddef.h>
+#include <stdlib.h>
+
+#if defined(_WIN32) || defined(_WIN64)
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#if !defined(MAP_ANONYMOUS) && !defined(MAP_ANON)
+// strict ISO C modes hide both, a private mapping of
+// /dev/zero is the POSIX equivalent
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#endif
+
+#ifndef CHIP8_JIT_CODE_SIZE
+#define CHIP8_JIT_CODE_SIZE (1024 * 1024)
+#endif
+
+#define CHIP8_JIT_MAX_BLOCK 64
+#define CHIP8_JIT_MAX_BLOCK_CODE 4096 // upper bound of the code of one block
+#define CHIP8__JIT_MAX_INSN_CODE 1024 // upper bound of the code of one instruction and the exit after it
+
+// host registers
+#define CHIP8__RAX 0
+#define CHIP8__RCX 1
+#define CHIP8__RDX 2
+#define CHIP8__RBX 3
+#define CHIP8__RBP 5
+#define CHIP8__RSI 6
+#define CHIP8__RDI 7
+#define CHIP8__R14 14 // struct chip8*
+#define CHIP8__R15 15 // const chip8_u8* input
+
+// condition codes
+#define CHIP8__CC_AE 0x3
+#define CHIP8__CC_E 0x4
+#define CHIP8__CC_NE 0x5
+#define CHIP8__CC_A 0x7
+
+#define CHIP8__GUEST_I 16 // guest register slot of I
+
+// returns true if it left through a side exit
+typedef chip8_u8 (*chip8__jit_block_fn)(struct chip8* vm, const chip8_u8* input);
+
+struct chip8__jit_block
+{
+    chip8__jit_block_fn code; // NULL: interpret the instruction at this address
+    chip8_u16 end; // one past the last byte the block was translated from
+    chip8_u8 length; // instructions in the block
+    chip8_u8 translated;
+};
+
+struct chip8_jit
+{
+    chip8_u8* code;
+    chip8_u32 code_used;
+    const struct chip8* vm;
+    chip8_u32 generation;
+    chip8_u8 covered[4096 / 8]; // bytes some block was translated from
+    struct chip8__jit_block blocks[4096 / 2];
+};
+
+// state of the block being translated
+struct chip8__jit_asm
+{
+    chip8_u8* out;
+    const chip8_u8* covered; // chip8_jit::covered
+    signed char host[17]; // host register of each guest register, -1 if none
+    chip8_u8 dirty[17];
+    chip8_u8 free_count;
+    signed char free_regs[10];
+};
+
+static void chip8__jit_emit8(struct chip8__jit_asm* a, chip8_u8 value)
+{
+    *a->out++ = value;
+}
+
+static void chip8__jit_emit32(struct chip8__jit_asm* a, chip8_u32 value)
+{
+    for(int i = 0 ; i < 4 ; i++) chip8__jit_emit8(a, (chip8_u8)(value >> (i * 8)));
+}
+
+static void chip8__jit_rex(struct chip8__jit_asm* a, int reg, int index, int base)
+{
+    chip8_u8 rex = (chip8_u8)(0x40 | ((reg & 8) >> 1) | ((index & 8) >> 2) | ((base & 8) >> 3));
+    if(rex != 0x40) chip8__jit_emit8(a, rex);
+}
+
+// <op> reg, rm (both registers, 32 bit)
+static void chip8__jit_op_rr(struct chip8__jit_asm* a, chip8_u8 prefix, chip8_u8 opcode, int reg, int rm)
+{
+    chip8__jit_rex(a, reg, 0, rm);
+    if(prefix) chip8__jit_emit8(a, prefix);
+    chip8__jit_emit8(a, opcode);
+    chip8__jit_emit8(a, (chip8_u8)(0xC0 | ((reg & 7) << 3) | (rm & 7)));
+}
+
+// <op> reg, [vm + disp]
+static void chip8__jit_op_vm(struct chip8__jit_asm* a, chip8_u8 prefix, chip8_u8 opcode, int reg, chip8_u32 disp)
+{
+    chip8__jit_rex(a, reg, 0, CHIP8__R14);
+    if(prefix) chip8__jit_emit8(a, prefix);
+    chip8__jit_emit8(a, opcode);
+    chip8__jit_emit8(a, (chip8_u8)(0x80 | ((reg & 7) << 3) | (CHIP8__R14 & 7)));
+    chip8__jit_emit32(a, disp);
+}
+
+// <op> reg, [vm + index * scale + disp]
+static void chip8__jit_op_vm_index(struct chip8__jit_asm* a, chip8_u8 opcode, int reg, int index, chip8_u8 scale, chip8_u32 disp)
+{
+    chip8_u8 scale_bits = scale == 8 ? 3 : (scale == 4 ? 2 : (scale == 2 ? 1 : 0));
+    chip8__jit_rex(a, reg, index, CHIP8__R14);
+    chip8__jit_emit8(a, opcode);
+    chip8__jit_emit8(a, (chip8_u8)(0x80 | ((reg & 7) << 3) | 4));
+    chip8__jit_emit8(a, (chip8_u8)((scale_bits << 6) | ((index & 7) << 3) | (CHIP8__R14 & 7)));
+    chip8__jit_emit32(a, disp);
+}
+
+static void chip8__jit_mov_rr(struct chip8__jit_asm* a, int dst, int src)
+{
+    if(dst != src) chip8__jit_op_rr(a, 0, 0x89, src, dst);
+}
+
+static void chip8__jit_mov_ri(struct chip8__jit_asm* a, int dst, chip8_u32 imm)
+{
+    chip8__jit_rex(a, 0, 0, dst);
+    chip8__jit_emit8(a, (chip8_u8)(0xB8 + (dst & 7)));
+    chip8__jit_emit32(a, imm);
+}
+
+static void chip8__jit_mov64_ri(struct chip8__jit_asm* a, int dst, chip8_u64 imm)
+{
+    chip8__jit_emit8(a, (chip8_u8)(0x48 | ((dst & 8) >> 3)));
+    chip8__jit_emit8(a, (chip8_u8)(0xB8 + (dst & 7)));
+    for(int i = 0 ; i < 8 ; i++) chip8__jit_emit8(a, (chip8_u8)(imm >> (i * 8)));
+}
+
+static void chip8__jit_patch(chip8_u8* rel, const chip8_u8* target)
+{
+    chip8_u32 offset = (chip8_u32)(target - (rel + 4));
+    for(int i = 0 ; i < 4 ; i++) rel[i] = (chip8_u8)(offset >> (i * 8));
+}
+
+// jmp (cc < 0) or jcc to target, which is patched in later
+// when it is NULL. Returns where the offset went.
+static chip8_u8* chip8__jit_jump(struct chip8__jit_asm* a, int cc, const chip8_u8* target)
+{
+    if(cc < 0) chip8__jit_emit8(a, 0xE9);
+    else { chip8__jit_emit8(a, 0x0F); chip8__jit_emit8(a, (chip8_u8)(0x80 + cc)); }
+    chip8_u8* rel = a->out;
+    chip8__jit_emit32(a, 0);
+    if(target) chip8__jit_patch(rel, target);
+    return rel;
+}
+
+// ext: 0 add, 4 and, 5 sub, 7 cmp
+static void chip8__jit_alu_ri(struct chip8__jit_asm* a, int ext, int dst, chip8_u32 imm)
+{
+    chip8__jit_op_rr(a, 0, 0x81, ext, dst);
+    chip8__jit_emit32(a, imm);
+}
+
+// opcode: 0x01 add, 0x09 or, 0x21 and, 0x29 sub, 0x31 xor, 0x39 cmp, 0x85 test
+static void chip8__jit_alu_rr(struct chip8__jit_asm* a, chip8_u8 opcode, int dst, int src)
+{
+    chip8__jit_op_rr(a, 0, opcode, src, dst);
+}
+
+static void chip8__jit_shr_ri(struct chip8__jit_asm* a, int dst, chip8_u8 imm)
+{
+    chip8__jit_op_rr(a, 0, 0xC1, 5, dst);
+    chip8__jit_emit8(a, imm);
+}
+
+static void chip8__jit_setcc(struct chip8__jit_asm* a, chip8_u8 cc, int dst)
+{
+    chip8__jit_op_rr(a, 0x0F, (chip8_u8)(0x90 + cc), 0, CHIP8__RAX); // setcc al
+    chip8__jit_op_rr(a, 0x0F, 0xB6, dst, CHIP8__RAX); // movzx dst, al
+}
+
+static void chip8__jit_cmov(struct chip8__jit_asm* a, chip8_u8 cc, int dst, int src)
+{
+    chip8__jit_op_rr(a, 0x0F, (chip8_u8)(0x40 + cc), dst, src);
+}
+
+static void chip8__jit_push(struct chip8__jit_asm* a, int reg)
+{
+    chip8__jit_rex(a, 0, 0, reg);
+    chip8__jit_emit8(a, (chip8_u8)(0x50 + (reg & 7)));
+}
+
+static void chip8__jit_pop(struct chip8__jit_asm* a, int reg)
+{
+    chip8__jit_rex(a, 0, 0, reg);
+    chip8__jit_emit8(a, (chip8_u8)(0x58 + (reg & 7)));
+}
+
+// registers the block function has to preserve
+#if defined(_WIN32) || defined(_WIN64)
+static const signed char chip8__jit_saved[] = { CHIP8__RBX, CHIP8__RBP, CHIP8__RSI, CHIP8__RDI, 12, 13, CHIP8__R14, CHIP8__R15 };
+#else
+static const signed char chip8__jit_saved[] = { CHIP8__RBX, CHIP8__RBP, 12, 13, CHIP8__R14, CHIP8__R15 };
+#endif
+
+static void chip8__jit_mov64_rr(struct chip8__jit_asm* a, int dst, int src)
+{
+    chip8__jit_emit8(a, (chip8_u8)(0x48 | ((src & 8) >> 1) | ((dst & 8) >> 3)));
+    chip8__jit_emit8(a, 0x89);
+    chip8__jit_emit8(a, (chip8_u8)(0xC0 | ((src & 7) << 3) | (dst & 7)));
+}
+
+static void chip8__jit_prologue(struct chip8__jit_asm* a)
+{
+    for(size_t i = 0 ; i < sizeof(chip8__jit_saved) ; i++) chip8__jit_push(a, chip8__jit_saved[i]);
+#if defined(_WIN32) || defined(_WIN64)
+    chip8__jit_mov64_rr(a, CHIP8__R14, CHIP8__RCX);
+    chip8__jit_mov64_rr(a, CHIP8__R15, CHIP8__RDX);
+#else
+    chip8__jit_mov64_rr(a, CHIP8__R14, CHIP8__RDI);
+    chip8__jit_mov64_rr(a, CHIP8__R15, CHIP8__RSI);
+#endif
+}
+
+static void chip8__jit_epilogue(struct chip8__jit_asm* a)
+{
+    for(size_t i = sizeof(chip8__jit_saved) ; i > 0 ; i--) chip8__jit_pop(a, chip8__jit_saved[i - 1]);
+    chip8__jit_emit8(a, 0xC3); // ret
+}
+
+static chip8_u32 chip8__jit_guest_offset(int guest)
+{
+    if(guest == CHIP8__GUEST_I) return (chip8_u32)offsetof(struct chip8, I);
+    return (chip8_u32)(offsetof(struct chip8, regs) + guest);
+}
+
+// Number of the guest registers in `guests` that do not
+// have a host register yet.
+static int chip8__jit_missing(const struct chip8__jit_asm* a, const int* guests, int count)
+{
+    int missing = 0;
+    for(int i = 0 ; i < count ; i++)
+    {
+        int seen = a->host[guests[i]] >= 0;
+        for(int j = 0 ; j < i ; j++) seen |= guests[j] == guests[i];
+        missing += !seen;
+    }
+    return missing;
+}
+
+// Host register holding guest register `guest`, loading
+// its value from the VM on first use if `load` is set.
+static int chip8__jit_reg(struct chip8__jit_asm* a, int guest, int load)
+{
+    if(a->host[guest] < 0)
+    {
+        int reg = a->free_regs[--a->free_count];
+        a->host[guest] = (signed char)reg;
+        if(load) chip8__jit_op_vm(a, 0x0F, guest == CHIP8__GUEST_I ? 0xB7 : 0xB6, reg, chip8__jit_guest_offset(guest));
+    }
+    return a->host[guest];
+}
+
+static int chip8__jit_write(struct chip8__jit_asm* a, int guest, int load)
+{
+    a->dirty[guest] = true;
+    return chip8__jit_reg(a, guest, load);
+}
+
+static void chip8__jit_writeback(struct chip8__jit_asm* a)
+{
+    for(int guest = 0 ; guest < 17 ; guest++)
+    {
+        if(!a->dirty[guest]) continue;
+        chip8__jit_mov_rr(a, CHIP8__RAX, a->host[guest]);
+        if(guest == CHIP8__GUEST_I) chip8__jit_emit8(a, 0x66);
+        chip8__jit_op_vm(a, 0, guest == CHIP8__GUEST_I ? 0x89 : 0x88, CHIP8__RAX, chip8__jit_guest_offset(guest));
+    }
+}
+
+static void chip8__jit_store_pc(struct chip8__jit_asm* a)
+{
+    chip8__jit_emit8(a, 0x66);
+    chip8__jit_op_vm(a, 0, 0x89, CHIP8__RAX, (chip8_u32)offsetof(struct chip8, PC)); // mov [vm + PC], ax
+}
+
+// PC = condition ? skip : next
+static void chip8__jit_skip(struct chip8__jit_asm* a, chip8_u8 cc, chip8_u16 pc)
+{
+    chip8__jit_mov_ri(a, CHIP8__RAX, pc + 2);
+    chip8__jit_mov_ri(a, CHIP8__RCX, pc + 4);
+    chip8__jit_cmov(a, cc, CHIP8__RAX, CHIP8__RCX);
+    chip8__jit_store_pc(a);
+}
+
+// Loads I & 0xFFF (I is in host register i) into ecx and
+// leaves through a side exit, with PC at the store, if
+// any of the `size` bytes from there on was translated
+// into some block. A store that wraps around the end of
+// memory leaves the same way, so ecx + offset addresses
+// every byte of it.
+static void chip8__jit_guard_store(struct chip8__jit_asm* a, int i, chip8_u8 size, chip8_u16 pc)
+{
+    chip8_u8* over = chip8__jit_jump(a, -1, NULL);
+    chip8_u8* side_exit = a->out;
+    chip8__jit_writeback(a);
+    chip8__jit_mov_ri(a, CHIP8__RAX, pc);
+    chip8__jit_store_pc(a);
+    chip8__jit_mov_ri(a, CHIP8__RAX, true);
+    chip8__jit_epilogue(a);
+    chip8__jit_patch(over, a->out);
+
+    chip8__jit_mov_rr(a, CHIP8__RCX, i);
+    chip8__jit_alu_ri(a, 4, CHIP8__RCX, 0xFFF);
+    chip8__jit_alu_ri(a, 7, CHIP8__RCX, 4096 - size);
+    chip8__jit_jump(a, CHIP8__CC_A, side_exit);
+    // the (at most 16) bits of the store start within the
+    // first byte of a 32 bit load from covered, bytes past
+    // its end only hold bits of addresses past 0xFFF
+    chip8__jit_mov64_ri(a, CHIP8__RAX, (chip8_u64)(size_t)a->covered);
+    chip8__jit_mov_rr(a, CHIP8__RDX, CHIP8__RCX);
+    chip8__jit_shr_ri(a, CHIP8__RDX, 3);
+    chip8__jit_emit8(a, 0x8B); // mov eax, [rax + rdx]
+    chip8__jit_emit8(a, 0x04);
+    chip8__jit_emit8(a, 0x10);
+    chip8__jit_mov_rr(a, CHIP8__RDX, CHIP8__RCX);
+    chip8__jit_alu_ri(a, 4, CHIP8__RCX, 7);
+    chip8__jit_emit8(a, 0xD3); // shr eax, cl
+    chip8__jit_emit8(a, 0xE8);
+    chip8__jit_mov_rr(a, CHIP8__RCX, CHIP8__RDX);
+    chip8__jit_alu_ri(a, 4, CHIP8__RAX, (1u << size) - 1);
+    chip8__jit_jump(a, CHIP8__CC_NE, side_exit);
+}
+
+// mov [vm + memory + rcx + offset], al
+static void chip8__jit_store_byte(struct chip8__jit_asm* a, chip8_u8 offset)
+{
+    chip8__jit_op_vm_index(a, 0x88, CHIP8__RAX, CHIP8__RCX, 1, (chip8_u32)(offsetof(struct chip8, memory) + offset));
+}
+
+// mov byte [vm + decoded + rdx * sizeof(insn) + slot * sizeof(insn)], CHIP8_OP_UNDECODED
+static void chip8__jit_undecode(struct chip8__jit_asm* a, chip8_u8 slot)
+{
+    chip8_u32 disp = (chip8_u32)(offsetof(struct chip8, decoded) + offsetof(struct chip8_insn, op) + slot * sizeof(struct chip8_insn));
+    chip8__jit_op_vm_index(a, 0xC6, 0, CHIP8__RDX, sizeof(struct chip8_insn), disp);
+    chip8__jit_emit8(a, CHIP8_OP_UNDECODED);
+}
+
+// Drops the predecoded slots of the `size` bytes stored at
+// ecx, like chip8_invalidate: the slot of ecx and the
+// (size - 1) / 2 after it, then the slot of the last byte,
+// which is either the last of those or the one after.
+static void chip8__jit_invalidate_store(struct chip8__jit_asm* a, chip8_u8 size)
+{
+    chip8__jit_mov_rr(a, CHIP8__RDX, CHIP8__RCX);
+    chip8__jit_shr_ri(a, CHIP8__RDX, 1);
+    for(chip8_u8 slot = 0 ; slot <= (size - 1) / 2 ; slot++) chip8__jit_undecode(a, slot);
+    if(size == 1) return;
+    chip8__jit_mov_rr(a, CHIP8__RDX, CHIP8__RCX);
+    chip8__jit_alu_ri(a, 0, CHIP8__RDX, size - 1);
+    chip8__jit_shr_ri(a, CHIP8__RDX, 1);
+    chip8__jit_undecode(a, 0);
+}
+
+// Guest registers an instruction uses, -1 if it can not
+// be translated at all.
+static int chip8__jit_uses(const struct chip8_insn* insn, int* guests)
+{
+    switch(insn->op)
+    {
+        case CHIP8_OP_SYS: case CHIP8_OP_UNKNOWN: case CHIP8_OP_JP:
+            return 0;
+        case CHIP8_OP_LD_VX_NN: case CHIP8_OP_ADD_VX_NN: case CHIP8_OP_SE_VX_NN: case CHIP8_OP_SNE_VX_NN:
+        case CHIP8_OP_LD_VX_DT: case CHIP8_OP_LD_DT_VX: case CHIP8_OP_LD_ST_VX: case CHIP8_OP_SKP: case CHIP8_OP_SKNP:
+            guests[0] = insn->x;
+            return 1;
+        case CHIP8_OP_LD_VX_VY: case CHIP8_OP_SE_VX_VY: case CHIP8_OP_SNE_VX_VY:
+            guests[0] = insn->x; guests[1] = insn->y;
+            return 2;
+        case CHIP8_OP_OR: case CHIP8_OP_AND: case CHIP8_OP_XOR:
+            guests[0] = insn->x; guests[1] = insn->y;
+#if CHIP8_QUIRK_VF_RESET
+            guests[2] = 15;
+            return 3;
+#else
+            return 2;
+#endif
+        case CHIP8_OP_ADD_VX_VY: case CHIP8_OP_SUB: case CHIP8_OP_SUBN:
+            guests[0] = insn->x; guests[1] = insn->y; guests[2] = 15;
+            return 3;
+        case CHIP8_OP_SHR: case CHIP8_OP_SHL:
+#if CHIP8_QUIRK_SHIFT_VY
+            guests[0] = insn->x; guests[1] = insn->y; guests[2] = 15;
+            return 3;
+#else
+            guests[0] = insn->x; guests[1] = 15;
+            return 2;
+#endif
+        case CHIP8_OP_LD_I_NNN:
+            guests[0] = CHIP8__GUEST_I;
+            return 1;
+        case CHIP8_OP_ADD_I_VX: case CHIP8_OP_LD_F_VX: case CHIP8_OP_LD_B_VX:
+            guests[0] = insn->x; guests[1] = CHIP8__GUEST_I;
+            return 2;
+        case CHIP8_OP_LD_MEM_VX: // V0-Vx are read from wherever they are
+            guests[0] = CHIP8__GUEST_I;
+            return 1;
+        default:
+            return -1;
+    }
+}
+
+// Emits one instruction, returns true if it ends the block.
+static chip8_u8 chip8__jit_translate_insn(struct chip8__jit_asm* a, const struct chip8_insn* insn, chip8_u16 pc)
+{
+    int x, y, f, i;
+    switch(insn->op)
+    {
+        case CHIP8_OP_JP:
+            chip8__jit_writeback(a);
+            chip8__jit_mov_ri(a, CHIP8__RAX, CHIP8_INSN_NNN(insn));
+            chip8__jit_store_pc(a);
+            return true;
+        case CHIP8_OP_SE_VX_NN:
+        case CHIP8_OP_SNE_VX_NN:
+            x = chip8__jit_reg(a, insn->x, true);
+            chip8__jit_writeback(a);
+            chip8__jit_alu_ri(a, 7, x, insn->nn);
+            chip8__jit_skip(a, insn->op == CHIP8_OP_SE_VX_NN ? CHIP8__CC_E : CHIP8__CC_NE, pc);
+            return true;
+        case CHIP8_OP_SE_VX_VY:
+        case CHIP8_OP_SNE_VX_VY:
+            x = chip8__jit_reg(a, insn->x, true);
+            y = chip8__jit_reg(a, insn->y, true);
+            chip8__jit_writeback(a);
+            chip8__jit_alu_rr(a, 0x39, x, y);
+            chip8__jit_skip(a, insn->op == CHIP8_OP_SE_VX_VY ? CHIP8__CC_E : CHIP8__CC_NE, pc);
+            return true;
+        case CHIP8_OP_SKP:
+        case CHIP8_OP_SKNP:
+            x = chip8__jit_reg(a, insn->x, true);
+            chip8__jit_writeback(a);
+            // movzx edx, byte [input + x]
+            chip8__jit_rex(a, CHIP8__RDX, x, CHIP8__R15);
+            chip8__jit_emit8(a, 0x0F);
+            chip8__jit_emit8(a, 0xB6);
+            chip8__jit_emit8(a, (chip8_u8)(((CHIP8__RDX & 7) << 3) | 4));
+            chip8__jit_emit8(a, (chip8_u8)(((x & 7) << 3) | (CHIP8__R15 & 7)));
+            chip8__jit_alu_rr(a, 0x85, CHIP8__RDX, CHIP8__RDX);
+            chip8__jit_skip(a, insn->op == CHIP8_OP_SKP ? CHIP8__CC_NE : CHIP8__CC_E, pc);
+            return true;
+        case CHIP8_OP_SYS:
+        case CHIP8_OP_UNKNOWN:
+            return false;
+        case CHIP8_OP_LD_VX_NN:
+            x = chip8__jit_write(a, insn->x, false);
+            chip8__jit_mov_ri(a, x, insn->nn);
+            return false;
+        case CHIP8_OP_ADD_VX_NN:
+            x = chip8__jit_write(a, insn->x, true);
+            chip8__jit_alu_ri(a, 0, x, insn->nn);
+            chip8__jit_alu_ri(a, 4, x, 0xFF);
+            return false;
+        case CHIP8_OP_LD_VX_VY:
+            y = chip8__jit_reg(a, insn->y, true);
+            x = chip8__jit_write(a, insn->x, false);
+            chip8__jit_mov_rr(a, x, y);
+            return false;
+        case CHIP8_OP_OR:
+        case CHIP8_OP_AND:
+        case CHIP8_OP_XOR:
+            y = chip8__jit_reg(a, insn->y, true);
+            x = chip8__jit_write(a, insn->x, true);
+            chip8__jit_alu_rr(a, insn->op == CHIP8_OP_OR ? 0x09 : (insn->op == CHIP8_OP_AND ? 0x21 : 0x31), x, y);
+#if CHIP8_QUIRK_VF_RESET
+            f = chip8__jit_write(a, 15, false);
+            chip8__jit_mov_ri(a, f, 0);
+#endif
+            return false;
+        // the flag is always written last, so VF ends up
+        // holding it when x is F
+        case CHIP8_OP_ADD_VX_VY:
+            y = chip8__jit_reg(a, insn->y, true);
+            x = chip8__jit_write(a, insn->x, true);
+            f = chip8__jit_write(a, 15, false);
+            chip8__jit_mov_rr(a, CHIP8__RAX, x);
+            chip8__jit_alu_rr(a, 0x01, CHIP8__RAX, y);
+            chip8__jit_mov_rr(a, CHIP8__RCX, CHIP8__RAX);
+            chip8__jit_shr_ri(a, CHIP8__RCX, 8);
+            chip8__jit_alu_ri(a, 4, CHIP8__RAX, 0xFF);
+            chip8__jit_mov_rr(a, x, CHIP8__RAX);
+            chip8__jit_mov_rr(a, f, CHIP8__RCX);
+            return false;
+        case CHIP8_OP_SUB:
+        case CHIP8_OP_SUBN:
+        {
+            y = chip8__jit_reg(a, insn->y, true);
+            x = chip8__jit_write(a, insn->x, true);
+            f = chip8__jit_write(a, 15, false);
+            // SUBN is SUB with the operands swapped
+            int lhs = insn->op == CHIP8_OP_SUB ? x : y;
+            int rhs = insn->op == CHIP8_OP_SUB ? y : x;
+            chip8__jit_mov_rr(a, CHIP8__RAX, lhs);
+            chip8__jit_alu_rr(a, 0x29, CHIP8__RAX, rhs);
+            chip8__jit_alu_ri(a, 4, CHIP8__RAX, 0xFF);
+            chip8__jit_alu_rr(a, 0x39, lhs, rhs);
+            chip8__jit_mov_rr(a, x, CHIP8__RAX); // keeps the flags
+            chip8__jit_setcc(a, CHIP8__CC_AE, f);
+            return false;
+        }
+        case CHIP8_OP_SHR:
+        case CHIP8_OP_SHL:
+#if CHIP8_QUIRK_SHIFT_VY
+            y = chip8__jit_reg(a, insn->y, true);
+            x = chip8__jit_write(a, insn->x, false);
+#else
+            x = chip8__jit_write(a, insn->x, true);
+            y = x;
+#endif
+            f = chip8__jit_write(a, 15, false);
+            chip8__jit_mov_rr(a, CHIP8__RAX, y);
+            chip8__jit_mov_rr(a, CHIP8__RCX, CHIP8__RAX);
+            if(insn->op == CHIP8_OP_SHR)
+            {
+                chip8__jit_alu_ri(a, 4, CHIP8__RCX, 1);
+                chip8__jit_shr_ri(a, CHIP8__RAX, 1);
+            }
+            else
+            {
+                chip8__jit_shr_ri(a, CHIP8__RCX, 7);
+                chip8__jit_alu_rr(a, 0x01, CHIP8__RAX, CHIP8__RAX);
+                chip8__jit_alu_ri(a, 4, CHIP8__RAX, 0xFF);
+            }
+            chip8__jit_mov_rr(a, x, CHIP8__RAX);
+            chip8__jit_mov_rr(a, f, CHIP8__RCX);
+            return false;
+        case CHIP8_OP_LD_I_NNN:
+            i = chip8__jit_write(a, CHIP8__GUEST_I, false);
+            chip8__jit_mov_ri(a, i, CHIP8_INSN_NNN(insn));
+            return false;
+        case CHIP8_OP_ADD_I_VX:
+            x = chip8__jit_reg(a, insn->x, true);
+            i = chip8__jit_write(a, CHIP8__GUEST_I, true);
+            chip8__jit_alu_rr(a, 0x01, i, x);
+            chip8__jit_alu_ri(a, 4, i, 0xFFFF);
+            return false;
+        case CHIP8_OP_LD_F_VX:
+            x = chip8__jit_reg(a, insn->x, true);
+            i = chip8__jit_write(a, CHIP8__GUEST_I, false);
+            chip8__jit_op_rr(a, 0, 0x6B, i, x); // imul i, x, 5
+            chip8__jit_emit8(a, 5);
+            return false;
+        case CHIP8_OP_LD_VX_DT:
+            x = chip8__jit_write(a, insn->x, false);
+            chip8__jit_op_vm(a, 0x0F, 0xB6, x, (chip8_u32)offsetof(struct chip8, DT));
+            return false;
+        case CHIP8_OP_LD_DT_VX:
+        case CHIP8_OP_LD_ST_VX:
+            x = chip8__jit_reg(a, insn->x, true);
+            chip8__jit_mov_rr(a, CHIP8__RAX, x);
+            chip8__jit_op_vm(a, 0, 0x88, CHIP8__RAX, (chip8_u32)(insn->op == CHIP8_OP_LD_DT_VX ? offsetof(struct chip8, DT) : offsetof(struct chip8, ST)));
+            return false;
+        // hundreds = x * 41 >> 12, tens = (x * 205 >> 11) -
+        // 10 * hundreds, ones = x - 10 * (x * 205 >> 11), all
+        // exact for 0-255
+        case CHIP8_OP_LD_B_VX:
+            x = chip8__jit_reg(a, insn->x, true);
+            i = chip8__jit_reg(a, CHIP8__GUEST_I, true);
+            chip8__jit_guard_store(a, i, 3, pc);
+            chip8__jit_op_rr(a, 0, 0x6B, CHIP8__RAX, x); // imul eax, x, 41
+            chip8__jit_emit8(a, 41);
+            chip8__jit_shr_ri(a, CHIP8__RAX, 12);
+            chip8__jit_store_byte(a, 0);
+            chip8__jit_op_rr(a, 0, 0x69, CHIP8__RAX, x); // imul eax, x, 205
+            chip8__jit_emit32(a, 205);
+            chip8__jit_shr_ri(a, CHIP8__RAX, 11);
+            chip8__jit_op_rr(a, 0, 0x6B, CHIP8__RDX, x); // imul edx, x, 41
+            chip8__jit_emit8(a, 41);
+            chip8__jit_shr_ri(a, CHIP8__RDX, 12);
+            chip8__jit_op_rr(a, 0, 0x6B, CHIP8__RDX, CHIP8__RDX); // imul edx, edx, 10
+            chip8__jit_emit8(a, 10);
+            chip8__jit_alu_rr(a, 0x29, CHIP8__RAX, CHIP8__RDX);
+            chip8__jit_store_byte(a, 1);
+            chip8__jit_op_rr(a, 0, 0x69, CHIP8__RAX, x); // imul eax, x, 205
+            chip8__jit_emit32(a, 205);
+            chip8__jit_shr_ri(a, CHIP8__RAX, 11);
+            chip8__jit_op_rr(a, 0, 0x6B, CHIP8__RAX, CHIP8__RAX); // imul eax, eax, 10
+            chip8__jit_emit8(a, 10);
+            chip8__jit_mov_rr(a, CHIP8__RDX, x);
+            chip8__jit_alu_rr(a, 0x29, CHIP8__RDX, CHIP8__RAX);
+            chip8__jit_mov_rr(a, CHIP8__RAX, CHIP8__RDX);
+            chip8__jit_store_byte(a, 2);
+            chip8__jit_invalidate_store(a, 3);
+            return false;
+        case CHIP8_OP_LD_MEM_VX:
+            i = chip8__jit_reg(a, CHIP8__GUEST_I, true);
+            chip8__jit_guard_store(a, i, insn->x + 1, pc);
+            for(int k = 0 ; k <= insn->x ; k++)
+            {
+                if(a->host[k] >= 0) chip8__jit_mov_rr(a, CHIP8__RAX, a->host[k]);
+                else chip8__jit_op_vm(a, 0x0F, 0xB6, CHIP8__RAX, chip8__jit_guest_offset(k)); // movzx eax, byte [vm + regs + k]
+                chip8__jit_store_byte(a, (chip8_u8)k);
+            }
+            chip8__jit_invalidate_store(a, insn->x + 1);
+#if CHIP8_QUIRK_LOAD_STORE_I
+            i = chip8__jit_write(a, CHIP8__GUEST_I, true);
+            chip8__jit_alu_ri(a, 0, i, insn->x + 1);
+            chip8__jit_alu_ri(a, 4, i, 0xFFFF);
+#endif
+            return false;
+    }
+    return true;
+}
+
+static void chip8__jit_flush(struct chip8_jit* jit)
+{
+    jit->code_used = 0;
+    chip8__memset(jit->covered, sizeof(jit->covered), 0);
+    for(chip8_u16 i = 0 ; i < 4096 / 2 ; i++) jit->blocks[i].translated = false;
+}
+
+// Switches the code cache between read/write (to emit into
+// it) and read/execute, returns false if the host refused.
+static chip8_u8 chip8__jit_protect(struct chip8_jit* jit, chip8_u8 executable)
+{
+#if defined(_WIN32) || defined(_WIN64)
+    DWORD previous;
+    return VirtualProtect(jit->code, CHIP8_JIT_CODE_SIZE, executable ? PAGE_EXECUTE_READ : PAGE_READWRITE, &previous) != 0;
+#else
+    return mprotect(jit->code, CHIP8_JIT_CODE_SIZE, executable ? PROT_READ | PROT_EXEC : PROT_READ | PROT_WRITE) == 0;
+#endif
+}
+
+static void chip8__jit_translate(struct chip8_jit* jit, struct chip8* vm, chip8_u16 start)
+{
+    static const signed char pool[10] = { 13, 12, CHIP8__RDI, CHIP8__RSI, CHIP8__RBP, CHIP8__RBX, 11, 10, 9, 8 };
+    struct chip8__jit_block* block = &jit->blocks[start >> 1];
+    struct chip8__jit_asm a;
+    struct chip8_insn scratch;
+
+    if(CHIP8_JIT_CODE_SIZE - jit->code_used < CHIP8_JIT_MAX_BLOCK_CODE) chip8__jit_flush(jit);
+
+    // a block that can not be emitted runs on the interpreter
+    block->translated = true;
+    block->length = 0;
+    block->end = (chip8_u16)(start + 2);
+    block->code = NULL;
+    if(!chip8__jit_protect(jit, false)) return;
+
+    a.out = jit->code + jit->code_used;
+    a.covered = jit->covered;
+    a.free_count = 10;
+    for(int i = 0 ; i < 10 ; i++) a.free_regs[i] = pool[i];
+    for(int i = 0 ; i < 17 ; i++) { a.host[i] = -1; a.dirty[i] = false; }
+
+    chip8_u8* entry = a.out;
+    chip8__jit_prologue(&a);
+
+    chip8_u16 pc = start;
+    chip8_u8 length = 0;
+    chip8_u8 ended = false;
+    while(!ended && length < CHIP8_JIT_MAX_BLOCK && pc < 4096 - 2 && a.out - entry <= CHIP8_JIT_MAX_BLOCK_CODE - CHIP8__JIT_MAX_INSN_CODE)
+    {
+        chip8__decode(vm, pc, &scratch);
+        int guests[3];
+        int count = chip8__jit_uses(&scratch, guests);
+        if(count < 0 || chip8__jit_missing(&a, guests, count) > a.free_count) break;
+        ended = chip8__jit_translate_insn(&a, &scratch, pc);
+        pc += 2;
+        length++;
+    }
+
+    if(length > 0)
+    {
+        if(!ended)
+        {
+            chip8__jit_writeback(&a);
+            chip8__jit_mov_ri(&a, CHIP8__RAX, pc);
+            chip8__jit_store_pc(&a);
+        }
+        chip8__jit_alu_rr(&a, 0x31, CHIP8__RAX, CHIP8__RAX); // no side exit
+        chip8__jit_epilogue(&a);
+    }
+    // no block may run from pages that are not executable
+    if(!chip8__jit_protect(jit, true))
+    {
+        chip8__jit_flush(jit);
+        return;
+    }
+    if(length == 0) return;
+
+    block->length = length;
+    block->end = pc;
+    block->code = (chip8__jit_block_fn)(void*)entry;
+    jit->code_used += (chip8_u32)(a.out - entry);
+    for(chip8_u16 address = start ; address < block->end ; address++) jit->covered[address >> 3] |= (chip8_u8)(1 << (address & 7));
+}
+
+struct chip8_jit* chip8_jit_create(void)
+{
+    struct chip8_jit* jit = (struct chip8_jit*)malloc(sizeof(struct chip8_jit));
+    if(jit == NULL) return NULL;
+#if defined(_WIN32) || defined(_WIN64)
+    jit->code = (chip8_u8*)VirtualAlloc(NULL, CHIP8_JIT_CODE_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+#else
+#if defined(MAP_ANONYMOUS)
+    void* code = mmap(NULL, CHIP8_JIT_CODE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#elif defined(MAP_ANON)
+    void* code = mmap(NULL, CHIP8_JIT_CODE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+#else
+    void* code = MAP_FAILED;
+    int zero = open("/dev/zero", O_RDWR);
+    if(zero >= 0)
+    {
+        code = mmap(NULL, CHIP8_JIT_CODE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE, zero, 0);
+        close(zero);
+    }
+#endif
+    jit->code = code == MAP_FAILED ? NULL : (chip8_u8*)code;
+#endif
+    if(jit->code == NULL) { free(jit); return NULL; }
+    // fails right away where executable memory is not allowed
+    if(!chip8__jit_protect(jit, true))
+    {
+        chip8_jit_destroy(jit);
+        return NULL;
+    }
+    jit->vm = NULL;
+    jit->generation = 0;
+    chip8__jit_flush(jit);
+    return jit;
+}
+
+void chip8_jit_destroy(struct chip8_jit* jit)
+{
+#if defined(_WIN32) || defined(_WIN64)
+    VirtualFree(jit->code, 0, MEM_RELEASE);
+#else
+    munmap(jit->code, CHIP8_JIT_CODE_SIZE);
+#endif
+    free(jit);
+}
+
+// Drops every block translated from a byte in the range.
+// Code space is not reclaimed until the cache fills up.
+void chip8_jit_invalidate(struct chip8_jit* jit, chip8_u16 address, chip8_u16 size)
+{
+    address &= 0xFFF;
+    if(address + size > 4096) // wrapped around the end of memory
+    {
+        chip8_jit_invalidate(jit, 0, (chip8_u16)(address + size - 4096));
+        size = (chip8_u16)(4096 - address);
+    }
+    chip8_u8 hit = false;
+    for(chip8_u32 i = address ; i < (chip8_u32)address + size && i < 4096 ; i++) hit |= (jit->covered[i >> 3] >> (i & 7)) & 1;
+    if(!hit) return;
+
+    chip8__memset(jit->covered, sizeof(jit->covered), 0);
+    for(chip8_u16 slot = 0 ; slot < 4096 / 2 ; slot++)
+    {
+        struct chip8__jit_block* block = &jit->blocks[slot];
+        if(!block->translated) continue;
+        chip8_u16 start = (chip8_u16)(slot * 2);
+        if(start < (chip8_u32)address + size && block->end > address) block->translated = false;
+        else if(block->code) for(chip8_u16 i = start ; i < block->end ; i++) jit->covered[i >> 3] |= (chip8_u8)(1 << (i & 7));
+    }
+}
+
+// Same contract as chip8_run. Breakpoints and traces are
+// not looked at inside blocks, so while any breakpoint is
+// set or a trace is on this just runs the predecoded core.
+chip8_u8 chip8_run_jit(struct chip8_jit* jit, struct chip8* vm, const chip8_u8* input, chip8_u32 max_cycles)
+{
+    if(vm->breakpoint_count || vm->trace) return chip8_run_predecoded(vm, input, max_cycles);
+    if(jit->vm != vm || jit->generation != vm->generation)
+    {
+        chip8__jit_flush(jit);
+        jit->vm = vm;
+        jit->generation = vm->generation;
+    }
+
+    struct chip8_insn scratch;
+    chip8_u8 stop_on_display = (vm->stop_flags & CHIP8_STOP_DISPLAY) != 0;
+    chip8_u8 result = CHIP8_EXIT_NONE;
+    chip8_u32 remaining = max_cycles;
+    for(;;)
+    {
+        if(vm->PC >= 4096) { result = CHIP8_EXIT_PC_OUT_OF_RANGE; break; }
+        if(remaining == 0) break;
+        if(!(vm->PC & 1))
+        {
+            struct chip8__jit_block* block = &jit->blocks[vm->PC >> 1];
+            if(!block->translated) chip8__jit_translate(jit, vm, vm->PC);
+            if(block->code && block->length <= remaining)
+            {
+                chip8_u16 start = vm->PC;
+                if(!block->code(vm, input))
+                {
+                    remaining -= block->length;
+                    if(vm->PC <= start) remaining -= chip8__skip_idle(vm, input, remaining); // looped back
+                    continue;
+                }
+                // side exit, the store at PC is run below
+                remaining -= (vm->PC - start) / 2;
+            }
+        }
+
+        // everything the JIT leaves alone, and stores (FX33,
+        // FX55) that would write over translated code
+        chip8_u16 address = vm->I;
+        const struct chip8_insn* insn = chip8__fetch(vm, &scratch);
+        chip8_u8 op = insn->op;
+        chip8_u8 x = insn->x;
+        remaining--;
+        chip8_u8 reason = chip8__execute(vm, insn, input);
+        if(op == CHIP8_OP_LD_B_VX) chip8_jit_invalidate(jit, address, 3);
+        else if(op == CHIP8_OP_LD_MEM_VX) chip8_jit_invalidate(jit, address, x + 1);
+        if(reason == CHIP8__EXIT_IDLE) { remaining -= chip8__skip_idle(vm, input, remaining); continue; }
+        if(reason != CHIP8_EXIT_NONE && (reason != CHIP8_EXIT_DISPLAY || stop_on_display)) { result = reason; break; }
+    }
+    vm->cycles += max_cycles - remaining;
+    return result;
+}
+
+#endif // CHIP8_JIT
+
 #endif
 
-#endif // CHIP8_H
\ No newline at end of file
+#endif // CHIP8_H
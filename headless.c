@@ -0,0 +1,143 @@
+// Runs a ROM without a window, GL or any UI library.
+//
+// Usage: chip8_headless [-c cycles] [-f frames] [-r hz] [-s seed] [-i script] rom
+//
+// Runs the ROM as fast as the host allows for the given
+// number of instructions or 1/60 s frames (whichever ends
+// first, 600 frames when neither is given), then prints
+// why it stopped, how far it got and a hash of the final
+// display. The script plays input back frame by frame,
+// one event per line:
+//
+//     # frame key down
+//     120 5 1
+//     125 5 0
+//
+// with the key as a hex digit and events sorted by frame.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CHIP8_PACKED_DISPLAY
+#define CHIP8_IMPLEMENTATION
+#include "chip8.h"
+#include "tools.h"
+
+#define HEADLESS_MAX_EVENTS 4096
+
+static struct script_event events[HEADLESS_MAX_EVENTS];
+static size_t event_count;
+
+static const char* const exit_names[] =
+{
+    "cycles", // CHIP8_EXIT_NONE
+    "display",
+    "key wait",
+    "breakpoint",
+    "halt",
+    "stack overflow",
+    "stack underflow",
+    "pc out of range",
+};
+
+// FNV-1a over one byte per pixel, so the hash does not
+// depend on the display layout chip8.h was built with
+static chip8_u64 hash_display(const struct chip8* vm)
+{
+    static chip8_u8 pixels[64 * 32];
+    chip8_unpack_display(vm, pixels);
+    chip8_u64 hash = 0xCBF29CE484222325ULL;
+    for(size_t i = 0 ; i < sizeof(pixels) ; i++)
+    {
+        hash ^= pixels[i];
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+static void usage(void)
+{
+    printf("Usage: chip8_headless [-c cycles] [-f frames] [-r hz] [-s seed] [-i script] rom\n");
+}
+
+int main(int argc, char** argv)
+{
+    unsigned long long max_cycles = ~0ULL;
+    unsigned long long max_frames = 0;
+    unsigned long clock_hz = CHIP8_DEFAULT_CLOCK_HZ;
+    unsigned long long seed = CHIP8_DEFAULT_SEED;
+    const char* script = NULL;
+    const char* rom_path = NULL;
+
+    for(int i = 1 ; i < argc ; i++)
+    {
+        if(argv[i][0] == '-' && argv[i][1] != '\0' && argv[i][2] == '\0' && i + 1 < argc)
+        {
+            const char* value = argv[++i];
+            switch(argv[i - 1][1])
+            {
+                case 'c': max_cycles = strtoull(value, NULL, 10); continue;
+                case 'f': max_frames = strtoull(value, NULL, 10); continue;
+                case 'r': clock_hz = strtoul(value, NULL, 10); continue;
+                case 's': seed = strtoull(value, NULL, 0); continue;
+                case 'i': script = value; continue;
+            }
+        }
+        else if(argv[i][0] != '-' && rom_path == NULL)
+        {
+            rom_path = argv[i];
+            continue;
+        }
+        usage();
+        return EXIT_FAILURE;
+    }
+    if(rom_path == NULL || clock_hz == 0) { usage(); return EXIT_FAILURE; }
+    if(max_frames == 0 && max_cycles == ~0ULL) max_frames = 600;
+    if(max_frames == 0) max_frames = ~0ULL;
+
+    chip8_u16 rom_size = 0;
+    chip8_u8* rom = read_file(rom_path, &rom_size);
+    if(rom == NULL) { printf("Unable to load ROM %s\n", rom_path); return EXIT_FAILURE; }
+    if(script != NULL && !read_script(script, events, HEADLESS_MAX_EVENTS, &event_count)) { free(rom); return EXIT_FAILURE; }
+
+    static struct chip8 vm;
+    chip8_init(&vm);
+    vm.clock_hz = (chip8_u32)clock_hz;
+    chip8_seed(&vm, seed);
+    chip8_load_rom(&vm, rom, rom_size);
+
+    chip8_u8 input[16] = {0};
+    chip8_u8 reason = CHIP8_EXIT_NONE;
+    unsigned long long frames = 0;
+    size_t next_event = 0;
+    while(frames < max_frames && vm.cycles < max_cycles)
+    {
+        for( ; next_event < event_count && events[next_event].frame <= frames ; next_event++)
+            input[events[next_event].key] = events[next_event].pressed;
+
+        // the cycle budget may end in the middle of a frame
+        chip8_run_frame_part(&vm, input, 0);
+        unsigned long long left = max_cycles - vm.cycles;
+        if(left < vm.frame_cycles)
+        {
+            reason = chip8_run_frame_part(&vm, input, (chip8_u32)left);
+            if(!CHIP8_EXIT_IS_FATAL(reason)) reason = CHIP8_EXIT_NONE;
+            break;
+        }
+        reason = chip8_run_frame(&vm, input);
+        if(CHIP8_EXIT_IS_FATAL(reason)) break;
+        reason = CHIP8_EXIT_NONE;
+        if(!vm.frame_open) frames++;
+    }
+
+    printf("rom: %s\n", rom_path);
+    printf("exit: %s\n", reason == CHIP8_EXIT_NONE && frames == max_frames ? "frames" : exit_names[reason]);
+    printf("cycles: %llu\n", (unsigned long long)vm.cycles);
+    printf("frames: %llu\n", frames);
+    printf("pc: %03X\n", vm.PC);
+    printf("display: %016llx\n", (unsigned long long)hash_display(&vm));
+
+    free(rom);
+    return CHIP8_EXIT_IS_FATAL(reason) && reason != CHIP8_EXIT_HALT ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -1,4 +1,3 @@
-
 #define CGL_LOGGING_ENABLED
 #define CGL_IMPLEMENTATION
 #include "cgl.h"
@@ -23,18 +22,14 @@
 #endif
 
 
-#ifndef CHIP8_NO_UI
-#define chip8_log(...) sprintf(buffer, __VA_ARGS__)
-#endif
-
-#define chip8_rand rand
-
-static char buffer[4096];
-
-
+#define CHIP8_PACKED_DISPLAY
 #define CHIP8_IMPLEMENTATION
 #include "chip8.h"
 
+// Leaves the nuklear control panel (status, Trace checkbox,
+// trace and disassembly views, start/pause/step buttons) out.
+// Building with it removed needs nuklear_glfw_gl4.h, which
+// is not part of the tree.
 #define CHIP8_NO_UI
 
 #ifndef CHIP8_NO_UI
@@ -49,25 +44,159 @@ static struct {
 
 static struct
 {
-    float scale_x;
-    float scale_y;
-    float offset_x;
-    float offset_y;
-    CGL_tilemap* tilemap;
-} tilemap_data;
-
-
-static struct chip8 vm;
-static chip8_u8 input[16];
-static bool has_exited = false;
-static bool is_running = false;
+    CGL_texture* texture; // the packed display, 8 x 32 bytes of 8 pixels each
+    CGL_shader* shader;
+    CGL_mesh_gpu* mesh;
+    int u_display;
+    int u_pixel_size;
+    int u_on_color;
+    int u_off_color;
+} display_data;
+
+
+#define TRACE_CAPACITY 4096 // power of two
+#define TRACE_SHOWN 4 // newest trace entries the UI shows
+#define CODE_SHOWN 4 // instructions from PC on the UI shows
+
+// What the render thread needs from the VM, copied out
+// by the emulation thread after every batch.
+struct frame
+{
+    chip8_u64 display[32];
+    chip8_u8 regs[16];
+    chip8_u16 I;
+    chip8_u16 PC;
+    chip8_u8 DT;
+    chip8_u8 ST;
+    chip8_u8 SP;
+    chip8_u32 clock_hz;
+    bool is_running;
+    bool has_exited;
+    chip8_u8 trace_count; // entries in trace, 0 when not tracing
+    struct chip8_trace_entry trace[TRACE_SHOWN]; // newest first
+    chip8_u8 code[CODE_SHOWN * 2]; // memory from PC on, disassembled by the UI
+};
+
+// Lock free triple buffer, the emulation thread fills
+// frames[frames_back] and swaps it with frames_middle, the
+// render thread swaps frames[frames_front] with it when the
+// FRAME_FRESH bit says there is something newer. Neither
+// side ever waits for the other.
+#define FRAME_FRESH 4
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#define atomic_exchange_long(pointer, value) _InterlockedExchange((pointer), (value))
+#define atomic_load_long(pointer) _InterlockedOr((pointer), 0)
+#define atomic_store_long(pointer, value) _InterlockedExchange((pointer), (value))
+#else
+#define atomic_exchange_long(pointer, value) __atomic_exchange_n((pointer), (value), __ATOMIC_ACQ_REL)
+#define atomic_load_long(pointer) __atomic_load_n((pointer), __ATOMIC_ACQUIRE)
+#define atomic_store_long(pointer, value) __atomic_store_n((pointer), (value), __ATOMIC_RELEASE)
+#endif
+
+static struct frame frames[3];
+static volatile long frames_middle = 1;
+static long frames_back = 0; // emulation thread only
+static long frames_front = 2; // render thread only
+static volatile long quit_emulation = 0;
+static CGL_signal* wake_emulation; // commands, key events and quitting wake the emulation thread
+static chip8_u64 shown_display[32]; // what the display texture holds
+
+// Everything the UI asks of the VM goes through a single
+// producer (main thread) single consumer (emulation
+// thread) ring, which the emulation thread drains between
+// batches. Only the two indices are shared and each has
+// one writer, so neither side ever locks.
+enum command_type
+{
+    COMMAND_PAUSE,
+    COMMAND_RESUME,
+    COMMAND_STEP, // value = instructions
+    COMMAND_RESET,
+    COMMAND_LOAD_ROM, // data, value = size, data is freed by the emulation thread
+    COMMAND_SET_SPEED, // value = clock_hz
+    COMMAND_TRACE, // value = on / off
+};
+
+struct command
+{
+    chip8_u8 type;
+    chip8_u32 value;
+    chip8_u8* data;
+};
+
+#define COMMAND_CAPACITY 64 // power of two
+
+static struct command commands[COMMAND_CAPACITY];
+static volatile long commands_head = 0; // next slot to write, main thread
+static volatile long commands_tail = 0; // next slot to read, emulation thread
+
+// Key presses and releases, stamped with glfwGetTime() by
+// the key callback on the main thread and applied by the
+// emulation thread at the cycle that corresponds to that
+// time, so a tap shorter than a frame is not lost and the
+// latency does not depend on when the host polls.
+struct key_event
+{
+    double time;
+    chip8_u8 key;
+    chip8_u8 pressed;
+};
+
+#define KEY_EVENT_CAPACITY 256 // power of two
+
+static struct key_event key_events[KEY_EVENT_CAPACITY];
+static volatile long key_events_head = 0; // next slot to write, main thread
+static volatile long key_events_tail = 0; // next slot to read, emulation thread
+
+static const int keymap[16] =
+{
+    CGL_KEY_1, CGL_KEY_2, CGL_KEY_3, CGL_KEY_4,
+    CGL_KEY_Q, CGL_KEY_W, CGL_KEY_E, CGL_KEY_R,
+    CGL_KEY_A, CGL_KEY_S, CGL_KEY_D, CGL_KEY_F,
+    CGL_KEY_Z, CGL_KEY_X, CGL_KEY_C, CGL_KEY_V,
+};
+
+static struct chip8 vm; // owned by the emulation thread once it started
+static chip8_u8 input[16]; // emulation thread only, driven by key_events
+static bool has_exited = false; // emulation thread only, the UI reads frames
+static bool is_running = false; // emulation thread only, the UI reads frames
+static chip8_u8* rom_data = NULL; // the loaded ROM, kept for COMMAND_RESET
+static chip8_u16 rom_size = 0;
+static chip8_u32 clock_hz = CHIP8_DEFAULT_CLOCK_HZ; // main thread's copy of vm.clock_hz for the UI
 static char path[4096];
+static double timer_accumulator = 0.0;
+static bool waiting_for_key = false; // the last instruction run was a LD Vx, K still waiting
+static bool needs_redraw = true; // the window contents are out of date
+static struct chip8_trace_entry trace_entries[TRACE_CAPACITY]; // emulation thread only
+static struct chip8_trace trace; // emulation thread only
+
 
 
+#define PIXEL_SIZE 10 // size of a CHIP-8 pixel in screen pixels
 
-#define TILE_COUNT_X 64
-#define TILE_COUNT_Y 32
+#define MAX_CATCH_UP 0.25 // seconds of emulation to catch up on after a stall
+#define TURBO_BUDGET (1.0 / 120.0) // seconds of host time per frame spent in turbo mode
+#define TURBO_BATCH 4096
 
+// Called from the main thread only, returns false when
+// the ring is full.
+bool send_command(chip8_u8 type, chip8_u32 value, chip8_u8* data)
+{
+    long head = commands_head;
+    if(head - atomic_load_long(&commands_tail) == COMMAND_CAPACITY) return false;
+    struct command* command = &commands[head & (COMMAND_CAPACITY - 1)];
+    command->type = type;
+    command->value = value;
+    command->data = data;
+    atomic_store_long(&commands_head, head + 1);
+    CGL_signal_notify(wake_emulation);
+    return true;
+}
+
+// Reads the ROM on the main thread and hands it over to
+// the emulation thread to load.
 bool load_rom(const char* path)
 {
     chip8_u8* data = NULL;
@@ -86,12 +215,18 @@ bool load_rom(const char* path)
     fread(data, 1, size, file);
     fclose(file);
 
-    if(!chip8_load_rom(&vm, data, size)) { free(data); return false;}
+    if(!send_command(COMMAND_LOAD_ROM, size, data)) { free(data); return false; }
 
-    free(data);
+    return true;
+}
+
+bool restart_rom(void)
+{
+    if(rom_data == NULL || !chip8_load_rom(&vm, rom_data, rom_size)) return false;
 
     is_running = false;
     has_exited = false;
+    waiting_for_key = false;
 
 #ifdef CHIP8_NO_UI
     is_running = true;
@@ -100,6 +235,314 @@ bool load_rom(const char* path)
     return true;
 }
 
+// Drains the command ring on the emulation thread,
+// returns true if anything was done.
+bool run_commands(void)
+{
+    long tail = commands_tail;
+    long head = atomic_load_long(&commands_head);
+    if(tail == head) return false;
+    for( ; tail != head ; tail++)
+    {
+        struct command* command = &commands[tail & (COMMAND_CAPACITY - 1)];
+        switch(command->type)
+        {
+        case COMMAND_PAUSE: is_running = false; break;
+        case COMMAND_RESUME: is_running = true; break;
+        case COMMAND_STEP:
+            if(!is_running && !has_exited)
+            {
+                chip8_u8 reason = chip8_run(&vm, input, command->value);
+                has_exited = CHIP8_EXIT_IS_FATAL(reason);
+            }
+            break;
+        case COMMAND_RESET:
+            if(!restart_rom()) printf("No ROM to reset\n");
+            break;
+        case COMMAND_LOAD_ROM:
+            free(rom_data);
+            rom_data = command->data;
+            rom_size = (chip8_u16)command->value;
+            if(!restart_rom()) printf("Unable to load ROM\n");
+            break;
+        case COMMAND_SET_SPEED: vm.clock_hz = command->value; break;
+        case COMMAND_TRACE:
+            chip8_trace_init(&trace, trace_entries, TRACE_CAPACITY);
+            chip8_set_trace(&vm, command->value ? &trace : NULL);
+            break;
+        }
+    }
+    atomic_store_long(&commands_tail, tail);
+    return true;
+}
+
+// Applies the next key event if it happened before `time`,
+// returns false if there is none.
+bool apply_key_event(double time)
+{
+    long tail = key_events_tail;
+    if(tail == atomic_load_long(&key_events_head)) return false;
+    struct key_event* event = &key_events[tail & (KEY_EVENT_CAPACITY - 1)];
+    if(event->time >= time) return false;
+    input[event->key] = event->pressed;
+    atomic_store_long(&key_events_tail, tail + 1);
+    return true;
+}
+
+// Peeks at the time of the next key event, returns false
+// if there is none.
+bool next_key_event(double* time)
+{
+    long tail = key_events_tail;
+    if(tail == atomic_load_long(&key_events_head)) return false;
+    *time = key_events[tail & (KEY_EVENT_CAPACITY - 1)].time;
+    return true;
+}
+
+// Runs the 1/60 s frame that started at host time
+// `frame_start`, applying every key event from that span
+// at the instruction it lines up with.
+chip8_u8 run_frame(double frame_start)
+{
+    double frame_end = frame_start + 1.0 / CHIP8_TIMER_HZ;
+    chip8_u8 reason = chip8_run_frame_part(&vm, input, 0); // opens the frame
+    chip8_u32 length = vm.frame_cycles; // the whole frame unless a breakpoint stopped the last one early
+    double time;
+    while(next_key_event(&time) && time < frame_end)
+    {
+        double offset = (time - frame_start) * CHIP8_TIMER_HZ * length;
+        chip8_u32 at = offset <= 0.0 ? 0 : (chip8_u32)offset;
+        chip8_u32 done = length - vm.frame_cycles;
+        if(at > done)
+        {
+            reason = chip8_run_frame_part(&vm, input, at - done);
+            if(CHIP8_EXIT_IS_FATAL(reason) || reason == CHIP8_EXIT_BREAKPOINT) return reason;
+        }
+        apply_key_event(frame_end);
+    }
+    return chip8_run_frame(&vm, input);
+}
+
+// Advances the emulation by `elapsed` seconds of wall time.
+// The timers always tick 60 times per second while the CPU
+// runs vm.clock_hz instructions per second, or as many as
+// fit in TURBO_BUDGET when vm.clock_hz is 0 (unlimited),
+// so the speed no longer depends on the refresh rate.
+void run_emulation(double elapsed)
+{
+    chip8_u8 reason = CHIP8_EXIT_NONE;
+
+    timer_accumulator += elapsed;
+    if(timer_accumulator > MAX_CATCH_UP) timer_accumulator = MAX_CATCH_UP;
+
+    double now = glfwGetTime();
+    if(vm.clock_hz == 0)
+    {
+        double deadline = now + TURBO_BUDGET;
+        do
+        {
+            while(apply_key_event(now));
+            reason = chip8_run(&vm, input, TURBO_BATCH);
+            waiting_for_key = reason == CHIP8_EXIT_KEY_WAIT;
+            now = glfwGetTime();
+        }
+        while(reason == CHIP8_EXIT_NONE && now < deadline);
+    }
+
+    // the frames that are due started timer_accumulator ago
+    double frame_start = now - timer_accumulator;
+    while(!CHIP8_EXIT_IS_FATAL(reason) && reason != CHIP8_EXIT_BREAKPOINT && timer_accumulator >= 1.0 / CHIP8_TIMER_HZ)
+    {
+        reason = run_frame(frame_start);
+        waiting_for_key = reason == CHIP8_EXIT_KEY_WAIT;
+        timer_accumulator -= 1.0 / CHIP8_TIMER_HZ;
+        frame_start += 1.0 / CHIP8_TIMER_HZ;
+    }
+
+    if(CHIP8_EXIT_IS_FATAL(reason)) has_exited = true;
+    if(reason == CHIP8_EXIT_BREAKPOINT) is_running = false;
+}
+
+static const char* DISPLAY_VERTEX_SHADER = "#version 430 core\n"
+"\n"
+"layout (location = 0) in vec4 position;\n"
+"layout (location = 1) in vec4 normal;\n"
+"layout (location = 2) in vec4 texcoord;\n"
+"\n"
+"void main()\n"
+"{\n"
+"    gl_Position = vec4(position.xyz, 1.0f);\n"
+"}";
+
+void publish_frame(bool wake)
+{
+    struct frame* frame = &frames[frames_back];
+    memcpy(frame->display, vm.display, sizeof(frame->display));
+    memcpy(frame->regs, vm.regs, sizeof(frame->regs));
+    frame->I = vm.I;
+    frame->PC = vm.PC;
+    frame->DT = vm.DT;
+    frame->ST = vm.ST;
+    frame->SP = vm.SP;
+    frame->clock_hz = vm.clock_hz;
+    frame->is_running = is_running;
+    frame->has_exited = has_exited;
+    for(int i = 0 ; i < CODE_SHOWN * 2 ; i++) frame->code[i] = vm.memory[(vm.PC + i) & 0xFFF];
+    frame->trace_count = 0;
+    while(vm.trace && frame->trace_count < TRACE_SHOWN)
+    {
+        const struct chip8_trace_entry* entry = chip8_trace_get(vm.trace, frame->trace_count);
+        if(entry == NULL) break;
+        frame->trace[frame->trace_count++] = *entry;
+    }
+    frames_back = atomic_exchange_long(&frames_middle, frames_back | FRAME_FRESH) & ~FRAME_FRESH;
+    if(wake) glfwPostEmptyEvent();
+}
+
+// Returns true and moves frames_front to the newest frame
+// if one was published since the last call.
+bool take_frame(void)
+{
+    if(!(atomic_load_long(&frames_middle) & FRAME_FRESH)) return false;
+    frames_front = atomic_exchange_long(&frames_middle, frames_front) & ~FRAME_FRESH;
+    return true;
+}
+
+// Runs the VM on its own clock, independent of how long
+// presenting takes, and publishes a frame after every
+// batch. The render thread is only woken up when there is
+// something new to show.
+void emulation_thread(void* argument)
+{
+    double last_time = glfwGetTime();
+    while(!atomic_load_long(&quit_emulation))
+    {
+        double now = glfwGetTime();
+        double elapsed = now - last_time;
+        last_time = now;
+
+        bool was_running = is_running, had_exited = has_exited;
+        bool changed = run_commands();
+        if(!has_exited && is_running) run_emulation(elapsed);
+        else while(apply_key_event(now)); // keep the keys current for stepping
+
+        changed = chip8_consume_dirty(&vm).rows != 0 || changed || was_running != is_running || had_exited != has_exited;
+#ifndef CHIP8_NO_UI
+        changed = changed || is_running; // the registers are on screen
+#endif
+        publish_frame(changed);
+
+        // Paused, exited or parked in a key wait with no timer
+        // left to count down, nothing can happen before a
+        // command or key arrives, so sleep until one does. A
+        // key wait with running timers still wakes up to
+        // tick them every 1/60 s.
+        uint64_t timeout = CGL_SIGNAL_INFINITE;
+        if(!has_exited && is_running && !(waiting_for_key && vm.DT == 0 && vm.ST == 0))
+        {
+            double wait = vm.clock_hz == 0 && !waiting_for_key ? 0.0 : 1.0 / CHIP8_TIMER_HZ - timer_accumulator;
+            timeout = wait > 0.0 ? (uint64_t)(wait * 1000.0) + 1 : 0;
+        }
+        if(timeout > 0) CGL_signal_wait(wake_emulation, timeout);
+    }
+}
+
+// Every texel holds 8 pixels. The rows are uploaded
+// straight from vm.display, i.e. as little endian 64 bit
+// words with bit 63 for the leftmost pixel, so pixel x is
+// bit 7 - x % 8 of byte 7 - x / 8.
+static const char* DISPLAY_FRAGMENT_SHADER = "#version 430 core\n"
+"\n"
+"out vec4 FragColor;\n"
+"\n"
+"uniform usampler2D u_display;\n"
+"uniform float u_pixel_size;\n"
+"uniform vec3 u_on_color;\n"
+"uniform vec3 u_off_color;\n"
+"\n"
+"void main()\n"
+"{\n"
+"    ivec2 pixel = ivec2(gl_FragCoord.xy / u_pixel_size);\n"
+"    if(pixel.x >= 64 || pixel.y >= 32)\n"
+"    {\n"
+"        FragColor = vec4(0.0f);\n"
+"        return;\n"
+"    }\n"
+"    uint bits = texelFetch(u_display, ivec2(7 - pixel.x / 8, 31 - pixel.y), 0).r;\n"
+"    float lit = float((bits >> uint(7 - pixel.x % 8)) & 1u);\n"
+"    FragColor = vec4(mix(u_off_color, u_on_color, lit), 1.0f);\n"
+"}";
+
+void create_display(void)
+{
+    display_data.texture = CGL_texture_create_blank(8, 32, GL_RED_INTEGER, GL_R8UI, GL_UNSIGNED_BYTE);
+    CGL_texture_bind(display_data.texture, 0);
+    CGL_texture_set_scaling_method(display_data.texture, GL_NEAREST); // integer textures can not be filtered
+    CGL_mesh_cpu* quad = CGL_mesh_cpu_quad((CGL_vec3){ 1.0,  1.0, 0.0},
+                                           (CGL_vec3){ 1.0, -1.0, 0.0},
+                                           (CGL_vec3){-1.0, -1.0, 0.0},
+                                           (CGL_vec3){-1.0,  1.0, 0.0});
+    display_data.mesh = CGL_mesh_gpu_create();
+    CGL_mesh_gpu_upload(display_data.mesh, quad, true);
+    CGL_mesh_cpu_destroy(quad);
+    display_data.shader = CGL_shader_create(DISPLAY_VERTEX_SHADER, DISPLAY_FRAGMENT_SHADER, NULL);
+    display_data.u_display = CGL_shader_get_uniform_location(display_data.shader, "u_display");
+    display_data.u_pixel_size = CGL_shader_get_uniform_location(display_data.shader, "u_pixel_size");
+    display_data.u_on_color = CGL_shader_get_uniform_location(display_data.shader, "u_on_color");
+    display_data.u_off_color = CGL_shader_get_uniform_location(display_data.shader, "u_off_color");
+}
+
+void destroy_display(void)
+{
+    CGL_mesh_gpu_destroy(display_data.mesh);
+    CGL_shader_destroy(display_data.shader);
+    CGL_texture_destroy(display_data.texture);
+}
+
+// Uploads the rows of the frame that differ from what the
+// texture holds, 8 bytes each, returns false (without
+// touching the GPU) if nothing changed. Comparing against
+// the last upload rather than using the VM's dirty rows
+// keeps this right when the render thread skipped frames.
+bool update_display(const struct frame* frame)
+{
+    int first = 0, last = 31;
+    while(first < 32 && frame->display[first] == shown_display[first]) first++;
+    if(first == 32) return false;
+    while(frame->display[last] == shown_display[last]) last--;
+    CGL_texture_set_sub_data(display_data.texture, 0, first, 8, last - first + 1, (void*)&frame->display[first]);
+    memcpy(&shown_display[first], &frame->display[first], (last - first + 1) * sizeof(chip8_u64));
+    return true;
+}
+
+void render_display(void)
+{
+    CGL_shader_bind(display_data.shader);
+    CGL_texture_bind(display_data.texture, 0);
+    CGL_shader_set_uniform_int(display_data.shader, display_data.u_display, 0);
+    CGL_shader_set_uniform_float(display_data.shader, display_data.u_pixel_size, (float)PIXEL_SIZE);
+    CGL_shader_set_uniform_vec3v(display_data.shader, display_data.u_on_color, 0.5f, 0.5f, 0.5f);
+    CGL_shader_set_uniform_vec3v(display_data.shader, display_data.u_off_color, 0.0f, 0.0f, 0.0f);
+    CGL_mesh_gpu_render(display_data.mesh);
+}
+
+// Sleeps until there is something to do, either input or
+// a frame the emulation thread woke us up for.
+void wait_events(void)
+{
+    glfwWaitEvents();
+}
+
+void framebuffer_size_func(CGL_window* window, int width, int height)
+{
+    needs_redraw = true;
+}
+
+void refresh_func(GLFWwindow* window)
+{
+    needs_redraw = true;
+}
+
 void drop_func(GLFWwindow* window, int path_count, const char** paths)
 {
     path[0] = '\0';
@@ -107,37 +550,43 @@ void drop_func(GLFWwindow* window, int path_count, const char** paths)
     if(!load_rom(path)) printf("Unable to load ROM %s", path);
 }
 
-void update_input(CGL_window* window)
+void key_func(CGL_window* window, int key, int scancode, int action, int mods)
 {
-    input[0] = CGL_window_get_key(window, CGL_KEY_1) == CGL_PRESS;
-    input[1] = CGL_window_get_key(window, CGL_KEY_2) == CGL_PRESS;
-    input[2] = CGL_window_get_key(window, CGL_KEY_3) == CGL_PRESS;
-    input[3] = CGL_window_get_key(window, CGL_KEY_4) == CGL_PRESS;
-    input[4] = CGL_window_get_key(window, CGL_KEY_Q) == CGL_PRESS;
-    input[5] = CGL_window_get_key(window, CGL_KEY_W) == CGL_PRESS;
-    input[6] = CGL_window_get_key(window, CGL_KEY_E) == CGL_PRESS;
-    input[7] = CGL_window_get_key(window, CGL_KEY_R) == CGL_PRESS;
-    input[8] = CGL_window_get_key(window, CGL_KEY_A) == CGL_PRESS;
-    input[9] = CGL_window_get_key(window, CGL_KEY_S) == CGL_PRESS;
-    input[10] = CGL_window_get_key(window, CGL_KEY_D) == CGL_PRESS;
-    input[11] = CGL_window_get_key(window, CGL_KEY_F) == CGL_PRESS;
-    input[12] = CGL_window_get_key(window, CGL_KEY_Z) == CGL_PRESS;
-    input[13] = CGL_window_get_key(window, CGL_KEY_X) == CGL_PRESS;
-    input[14] = CGL_window_get_key(window, CGL_KEY_C) == CGL_PRESS;
-    input[15] = CGL_window_get_key(window, CGL_KEY_V) == CGL_PRESS;
+    if(action == CGL_REPEAT) return;
+    for(chip8_u8 i = 0 ; i < 16 ; i++)
+    {
+        if(keymap[i] != key) continue;
+        long head = key_events_head;
+        if(head - atomic_load_long(&key_events_tail) == KEY_EVENT_CAPACITY) return; // the emulation thread is stuck, drop it
+        struct key_event* event = &key_events[head & (KEY_EVENT_CAPACITY - 1)];
+        event->time = glfwGetTime();
+        event->key = i;
+        event->pressed = action == CGL_PRESS;
+        atomic_store_long(&key_events_head, head + 1);
+        CGL_signal_notify(wake_emulation);
+        return;
+    }
 }
 
 
 int main(int argc, char** argv)
 {
-    if(argc == 2)
+    chip8_init(&vm);
+    chip8_seed(&vm, (chip8_u64)time(NULL));
+    wake_emulation = CGL_signal_create();
+
+    if(argc >= 2)
     {
         path[0] = '\0';
         strcat(path, argv[1]);
         if(!load_rom(path)) printf("Unable to load ROM %s", path);
     }
+    if(argc == 3)
+    {
+        clock_hz = (chip8_u32)strtoul(argv[2], NULL, 10); // 0 = unlimited
+        send_command(COMMAND_SET_SPEED, clock_hz, NULL);
+    }
 
-    srand((uint32_t)time(NULL));
     if(!CGL_init()) return -1;
     CGL_window* main_window = CGL_window_create(640, 340, "chip8");
     if(!main_window) return -1;
@@ -147,12 +596,8 @@ int main(int argc, char** argv)
 
     glfwSetDropCallback(CGL_window_get_glfw_handle(main_window), drop_func);
 
-    tilemap_data.offset_x = 0.0f;
-    tilemap_data.offset_y = 0.0f;
-    tilemap_data.scale_x = 1.0f;
-    tilemap_data.scale_y = 1.0f;
-    tilemap_data.tilemap = CGL_tilemap_create(TILE_COUNT_X, TILE_COUNT_Y, 10, 10, 0);
-    memset(input, 0, sizeof(input));
+    create_display();
+    memset(shown_display, 0, sizeof(shown_display));
 
 #ifndef CHIP8_NO_UI
 
@@ -168,43 +613,33 @@ int main(int argc, char** argv)
 #endif
 
     CGL_window_resecure_callbacks(main_window);
-    CGL_tilemap_set_auto_upload(tilemap_data.tilemap, false);
-
+    CGL_window_set_framebuffer_size_callback(main_window, framebuffer_size_func);
+    CGL_window_set_key_callback(main_window, key_func);
+    glfwSetWindowRefreshCallback(CGL_window_get_glfw_handle(main_window), refresh_func);
+
+    publish_frame(false);
+    take_frame();
+    CGL_thread* emulation = CGL_thread_create();
+    if(!CGL_thread_start(emulation, emulation_thread, NULL)) return -1;
+
+    // Only a changed display costs an upload and only a
+    // changed window a present, so a paused or static ROM
+    // leaves the CPU and GPU idle.
     while(!CGL_window_should_close(main_window))
     { 
-        if(!has_exited && is_running)
-        {
-            chip8_update_timer(&vm);
-            has_exited = !chip8_cycle(&vm, input);
-            // ideally you should play a buzzer sound
-            // if vm.ST is greater than 0 but i am
-            // not implementing sound at all here
-            // altough it can be easily done by
-            // printf("\a");
-            for(int i = 0 ; i < 32 ; i++)
-            {
-                for(int j = 0 ; j < 64 ; j++)
-                {
-                    float color = vm.display[i * 64 + j] == 1 ? 0.5f : 0.0f;
-                    CGL_tilemap_set_tile_color(tilemap_data.tilemap, j, 31 - i, color, color, color);
-                }
-            }
-            CGL_tilemap_upload(tilemap_data.tilemap);
-        }
-
-        {
-           CGL_framebuffer_bind(default_framebuffer);
-            CGL_gl_clear(0.2f, 0.2f, 0.2f, 1.0f);
-            int rx = 0, ry = 0;
-            CGL_framebuffer_get_size(default_framebuffer, &rx, &ry);
-            CGL_tilemap_render(tilemap_data.tilemap, tilemap_data.scale_x, tilemap_data.scale_y, tilemap_data.offset_x, tilemap_data.offset_y, NULL);
-        }
-
-        CGL_window_poll_events(main_window);
-
-        update_input(main_window);
+        // ideally you should play a buzzer sound
+        // if ST is greater than 0 but i am
+        // not implementing sound at all here
+        // altough it can be easily done by
+        // printf("\a");
+        if(take_frame() && update_display(&frames[frames_front])) needs_redraw = true;
 
 #ifndef CHIP8_NO_UI
+        // nuklear draws its whole UI every frame it is given
+        // and this loop only comes around for input or a
+        // running VM, so always present
+        needs_redraw = true;
+        const struct frame* frame = &frames[frames_front];
         nk_glfw3_new_frame(&nuklear_data.glfw);
 
         static char buffer2[4096];
@@ -214,56 +649,66 @@ int main(int argc, char** argv)
         {
             nk_layout_row_dynamic(nuklear_data.ctx, 30, 2);
             nk_label(nuklear_data.ctx, "Program Active : ", NK_TEXT_ALIGN_LEFT);
-            nk_label(nuklear_data.ctx, ( has_exited ? "No" : "Yes"), NK_TEXT_ALIGN_LEFT);
+            nk_label(nuklear_data.ctx, ( frame->has_exited ? "No" : "Yes"), NK_TEXT_ALIGN_LEFT);
 
             nk_layout_row_dynamic(nuklear_data.ctx, 30, 2);
             nk_label(nuklear_data.ctx, "Program Running : ", NK_TEXT_ALIGN_LEFT);
-            nk_label(nuklear_data.ctx, ( is_running ? "No" : "Yes"), NK_TEXT_ALIGN_LEFT);
+            nk_label(nuklear_data.ctx, ( frame->is_running ? "No" : "Yes"), NK_TEXT_ALIGN_LEFT);
 
             nk_layout_row_dynamic(nuklear_data.ctx, 30, 2);
             nk_label(nuklear_data.ctx, "ROM : ", NK_TEXT_ALIGN_LEFT);
             nk_label(nuklear_data.ctx, ( path == NULL ? "No ROM" : path), NK_TEXT_ALIGN_LEFT);
 
-            sprintf(buffer2, "Curent Instruction: %s", buffer);
+            // the trace is only formatted here, for the few
+            // entries shown
+            static nk_bool tracing = false; // whether the VM was asked to trace
             nk_layout_row_dynamic(nuklear_data.ctx, 30, 1);
-            nk_label(nuklear_data.ctx, buffer2, NK_TEXT_ALIGN_LEFT);
+            nk_bool new_tracing = tracing;
+            nk_checkbox_label(nuklear_data.ctx, "Trace", &new_tracing);
+            if(new_tracing != tracing && send_command(COMMAND_TRACE, new_tracing, NULL)) tracing = new_tracing;
+            for(chip8_u8 i = 0 ; i < frame->trace_count ; i++)
+            {
+                char text[CHIP8_TRACE_TEXT_SIZE];
+                chip8_trace_format(&frame->trace[i], text);
+                sprintf(buffer2, "%s%s", i == 0 ? "Last Instruction: " : "", text);
+                nk_layout_row_dynamic(nuklear_data.ctx, 30, 1);
+                nk_label(nuklear_data.ctx, buffer2, NK_TEXT_ALIGN_LEFT);
+            }
 
-            nk_layout_row_dynamic(nuklear_data.ctx, 30, 3);
-            if (nk_button_label(nuklear_data.ctx, "Start")) is_running = true;
-            if (nk_button_label(nuklear_data.ctx, "Pause")) is_running = false;
-            if (nk_button_label(nuklear_data.ctx, "Step")) 
+            // likewise only the instructions on screen are
+            // disassembled, however fast the VM runs
+            for(int i = 0 ; i < CODE_SHOWN ; i++)
             {
-                if(!is_running && !has_exited)
-                {
-                    chip8_update_timer(&vm);
-                    has_exited = !chip8_cycle(&vm);
-                    for(int i = 0 ; i < 32 ; i++)
-                    {
-                        for(int j = 0 ; j < 64 ; j++)
-                        {
-                            float color = vm.display[i * 64 + j] == 1 ? 0.5f : 0.0f;
-                            CGL_tilemap_set_tile_color(tilemap_data.tilemap, j, 31 - i, color, color, color);
-                        }
-                    }
-                }
+                char text[CHIP8_DISASSEMBLY_SIZE];
+                chip8_disassemble(frame->code, (chip8_u16)(i * 2), text);
+                sprintf(buffer2, "%s%03X: %s", i == 0 ? "Current Instruction: " : "", (frame->PC + i * 2) & 0xFFF, text);
+                nk_layout_row_dynamic(nuklear_data.ctx, 30, 1);
+                nk_label(nuklear_data.ctx, buffer2, NK_TEXT_ALIGN_LEFT);
             }
 
+            nk_layout_row_dynamic(nuklear_data.ctx, 30, 3);
+            if (nk_button_label(nuklear_data.ctx, "Start")) send_command(COMMAND_RESUME, 0, NULL);
+            if (nk_button_label(nuklear_data.ctx, "Pause")) send_command(COMMAND_PAUSE, 0, NULL);
+            if (nk_button_label(nuklear_data.ctx, "Step")) send_command(COMMAND_STEP, 1, NULL);
+
             nk_layout_row_dynamic(nuklear_data.ctx, 30, 1);
-            sprintf(buffer2, "I: %d PC: %d  ST: %d  DT: %d  SP: %d", vm.I, vm.PC, vm.ST, vm.DT, vm.SP);
+            sprintf(buffer2, "I: %d PC: %d  ST: %d  DT: %d  SP: %d", frame->I, frame->PC, frame->ST, frame->DT, frame->SP);
             nk_label(nuklear_data.ctx, buffer2, NK_TEXT_ALIGN_LEFT);
 
 
             nk_layout_row_dynamic(nuklear_data.ctx, 30, 1);
-            if (nk_button_label(nuklear_data.ctx, "Reset"))
-            {
-                if(!load_rom(path)) printf("Unable to load ROM %s", path);
-            }
+            if (nk_button_label(nuklear_data.ctx, "Reset")) send_command(COMMAND_RESET, 0, NULL);
+
+            nk_layout_row_dynamic(nuklear_data.ctx, 30, 1);
+            int new_clock_hz = (int)clock_hz;
+            nk_property_int(nuklear_data.ctx, "CPU Hz (0 = turbo)", 0, &new_clock_hz, 1000000, 100, 10.0f);
+            if((chip8_u32)new_clock_hz != clock_hz && send_command(COMMAND_SET_SPEED, (chip8_u32)new_clock_hz, NULL)) clock_hz = (chip8_u32)new_clock_hz;
 
             nk_layout_row_dynamic(nuklear_data.ctx, 30, 1);
             nk_label(nuklear_data.ctx, "Registors : ", NK_TEXT_ALIGN_LEFT);
             for(chip8_u8 i = 0 ; i < 16 ; i+=2)
             {
-                sprintf(buffer2, "V%c: %d     V%c: %d", chip8__to_hex(i), vm.regs[i], chip8__to_hex(i + 1), vm.regs[i + 1]);
+                sprintf(buffer2, "V%c: %d     V%c: %d", chip8__to_hex(i), frame->regs[i], chip8__to_hex(i + 1), frame->regs[i + 1]);
                 nk_layout_row_dynamic(nuklear_data.ctx, 30, 1);
                 nk_label(nuklear_data.ctx, buffer2, NK_TEXT_ALIGN_LEFT);
             }
@@ -275,18 +720,36 @@ int main(int argc, char** argv)
 
         }
         nk_end(nuklear_data.ctx);
-        nk_glfw3_render(&nuklear_data.glfw, NK_ANTI_ALIASING_ON, 1024 * 512, 1024 * 128);
 #endif
 
-        CGL_window_swap_buffers(main_window);
+        if(needs_redraw)
+        {
+            CGL_framebuffer_bind(default_framebuffer);
+            CGL_gl_clear(0.2f, 0.2f, 0.2f, 1.0f);
+            render_display();
+#ifndef CHIP8_NO_UI
+            nk_glfw3_render(&nuklear_data.glfw, NK_ANTI_ALIASING_ON, 1024 * 512, 1024 * 128);
+#endif
+            CGL_window_swap_buffers(main_window);
+            needs_redraw = false;
+        }
+
+        wait_events();
         if(CGL_window_get_key(main_window, CGL_KEY_ESCAPE) == CGL_PRESS) break;
     }
 
+    atomic_exchange_long(&quit_emulation, 1);
+    CGL_signal_notify(wake_emulation);
+    CGL_thread_destroy(emulation); // joins it
+    CGL_signal_destroy(wake_emulation);
+    run_commands(); // frees a ROM that was still in flight
+    free(rom_data);
+
 #ifndef CHIP8_NO_UI
     nk_glfw3_shutdown(&nuklear_data.glfw);
 #endif
 
-    CGL_tilemap_destroy(tilemap_data.tilemap);
+    destroy_display();
     CGL_framebuffer_destroy(default_framebuffer);
     CGL_gl_shutdown();
     CGL_window_destroy(main_window);
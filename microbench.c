@@ -0,0 +1,175 @@
+// Per opcode family microbenchmarks for the chip8.h cores.
+//
+// Usage: chip8_microbench [-n instructions] [-r repetitions] [case]
+//
+// Every case is a synthetic program: a few setup
+// instructions, then a loop of 64 instructions repeating
+// one pattern of the opcode family under test and a jump
+// back. Each case runs on every core, first untimed to warm
+// up the caches (and the JIT), then `repetitions` times
+// `instructions` instructions, and the time per instruction
+// is summarised over the repetitions. Only cases whose name
+// contains `case` run when it is given.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define CHIP8_JIT
+#endif
+
+#define CHIP8_IMPLEMENTATION
+#define CHIP8_TOOLS_CORES
+#include "chip8.h"
+#include "tools.h"
+
+#define MICRO_SEED 1234
+#define MICRO_BODY 64 // instructions in the loop, before the jump back
+#define MICRO_MAX_REPS 1000
+
+struct micro_case
+{
+    const char* name;
+    chip8_u16 setup[10]; // run once, 0 ends the list
+    chip8_u16 pattern[10]; // repeated to fill the loop
+    chip8_u8 pattern_length;
+};
+
+static const struct micro_case cases[] =
+{
+    // every 8XYn with different registers, so nothing
+    // depends on the instruction right before it
+    { "alu 8XYn", { 0x6013, 0x6137, 0x625A, 0x6381, 0x64C4, 0x65E9, 0x6602, 0x677F, 0 },
+        { 0x8010, 0x8121, 0x8232, 0x8343, 0x8454, 0x8565, 0x8676, 0x8707, 0x881E }, 9 },
+    { "drw height 1", { 0x6008, 0x6104, 0xA000, 0 }, { 0xD011 }, 1 },
+    { "drw height 5", { 0x6008, 0x6104, 0xA000, 0 }, { 0xD015 }, 1 },
+    { "drw height 15", { 0x6008, 0x6104, 0xA000, 0 }, { 0xD01F }, 1 },
+    // across the right and bottom edges
+    { "drw height 5 wrap", { 0x603C, 0x611E, 0xA000, 0 }, { 0xD015 }, 1 },
+    { "drw height 15 wrap", { 0x603C, 0x6118, 0xA000, 0 }, { 0xD01F }, 1 },
+    { "bcd FX33", { 0x63FE, 0xAE00, 0 }, { 0xF333 }, 1 },
+    // I is set again each time since FX55/FX65 may advance
+    // it, so half of these are LD I, NNN
+    { "store FX55", { 0 }, { 0xAE00, 0xFF55 }, 2 },
+    { "load FX65", { 0 }, { 0xAE00, 0xFF65 }, 2 },
+    // taken and not taken skips of every kind, the ADD is
+    // always skipped over
+    { "skip", { 0x6000, 0x6101, 0x6207, 0 },
+        { 0x3000, 0x7301, 0x4001, 0x7301, 0xE2A1, 0x7301, 0x5010, 0x9010, 0x7301, 0xE29E }, 10 },
+};
+
+#define CASE_COUNT (sizeof(cases) / sizeof(cases[0]))
+
+// Builds the program of a case, returns its size in bytes.
+static chip8_u16 build_rom(const struct micro_case* test, chip8_u8* rom)
+{
+    chip8_u16 size = 0;
+    for(int i = 0 ; i < 10 && test->setup[i] ; i++)
+    {
+        rom[size++] = test->setup[i] >> 8;
+        rom[size++] = test->setup[i] & 0xFF;
+    }
+    chip8_u16 loop = 0x200 + size;
+    // whole patterns only, a skip must never land on the jump
+    int repeats = MICRO_BODY / test->pattern_length;
+    for(int r = 0 ; r < repeats ; r++)
+    {
+        for(int i = 0 ; i < test->pattern_length ; i++)
+        {
+            rom[size++] = test->pattern[i] >> 8;
+            rom[size++] = test->pattern[i] & 0xFF;
+        }
+    }
+    rom[size++] = 0x10 | (loop >> 8);
+    rom[size++] = loop & 0xFF;
+    return size;
+}
+
+// Runs `count` instructions and returns the seconds it took.
+static double run_timed(const struct bench_core* core, struct chip8* vm, unsigned long long count)
+{
+    static const chip8_u8 input[16] = {0};
+    clock_t start = clock();
+    while(count > 0)
+    {
+        chip8_u32 batch = count < 0x40000000ULL ? (chip8_u32)count : 0x40000000;
+        chip8_u64 before = vm->cycles;
+        chip8_u8 reason = core->run(vm, input, batch);
+        count -= vm->cycles - before;
+        if(CHIP8_EXIT_IS_FATAL(reason)) { printf("%s stopped with exit reason %d\n", core->name, reason); exit(EXIT_FAILURE); }
+    }
+    return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+static int compare_doubles(const void* a, const void* b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char** argv)
+{
+    unsigned long long count = 1000000ULL;
+    int repetitions = 10;
+    const char* filter = NULL;
+
+    for(int i = 1 ; i < argc ; i++)
+    {
+        if(strcmp(argv[i], "-n") == 0 && i + 1 < argc) count = strtoull(argv[++i], NULL, 10);
+        else if(strcmp(argv[i], "-r") == 0 && i + 1 < argc) repetitions = atoi(argv[++i]);
+        else if(argv[i][0] != '-' && filter == NULL) filter = argv[i];
+        else { printf("Usage: chip8_microbench [-n instructions] [-r repetitions] [case]\n"); return EXIT_FAILURE; }
+    }
+    if(count == 0 || repetitions < 1 || repetitions > MICRO_MAX_REPS)
+    {
+        printf("Usage: chip8_microbench [-n instructions] [-r repetitions] [case]\n");
+        return EXIT_FAILURE;
+    }
+
+    static struct chip8 vm;
+    static double samples[MICRO_MAX_REPS];
+    chip8_u8 rom[256];
+
+    printf("%-20s %-12s %9s %9s %9s %9s   (ns/insn over %d runs of %llu)\n", "case", "core", "min", "median", "mean", "stddev", repetitions, count);
+    for(size_t c = 0 ; c < CASE_COUNT ; c++)
+    {
+        if(filter != NULL && strstr(cases[c].name, filter) == NULL) continue;
+        chip8_u16 rom_size = build_rom(&cases[c], rom);
+        for(size_t k = 0 ; k < CORE_COUNT ; k++)
+        {
+#ifdef CHIP8_JIT
+            if(cores[k].run == run_jit && (jit = chip8_jit_create()) == NULL)
+            {
+                printf("Unable to allocate the JIT code cache\n");
+                return EXIT_FAILURE;
+            }
+#endif
+            chip8_init(&vm);
+            chip8_seed(&vm, MICRO_SEED);
+            chip8_load_rom(&vm, rom, rom_size);
+            run_timed(&cores[k], &vm, count / 4 + 1); // warmup
+
+            double sum = 0.0;
+            for(int r = 0 ; r < repetitions ; r++)
+            {
+                samples[r] = run_timed(&cores[k], &vm, count) * 1e9 / count;
+                sum += samples[r];
+            }
+            double mean = sum / repetitions;
+            double variance = 0.0;
+            for(int r = 0 ; r < repetitions ; r++) variance += (samples[r] - mean) * (samples[r] - mean);
+            double stddev = repetitions > 1 ? sqrt(variance / (repetitions - 1)) : 0.0;
+            qsort(samples, repetitions, sizeof(double), compare_doubles);
+            double median = repetitions % 2 ? samples[repetitions / 2] : (samples[repetitions / 2 - 1] + samples[repetitions / 2]) / 2.0;
+            printf("%-20s %-12s %9.3f %9.3f %9.3f %9.3f\n", k == 0 ? cases[c].name : "", cores[k].name, samples[0], median, mean, stddev);
+
+#ifdef CHIP8_JIT
+            if(cores[k].run == run_jit) chip8_jit_destroy(jit);
+#endif
+        }
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,105 @@
+// Helpers shared by the command line tools (aot.c, bench.c,
+// headless.c, microbench.c). Include it after chip8.h, with
+// CHIP8_TOOLS_CORES defined to also get the table of cores
+// the benchmarks run.
+
+#ifndef CHIP8_TOOLS_H
+#define CHIP8_TOOLS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// one line of an input script
+struct script_event
+{
+    unsigned long long frame;
+    chip8_u8 key;
+    chip8_u8 pressed;
+};
+
+// Reads a whole ROM into a malloc'ed buffer, NULL if it can
+// not be read or does not fit above 0x200.
+static inline chip8_u8* read_file(const char* path, chip8_u16* size)
+{
+    FILE* file = fopen(path, "rb");
+    if(file == NULL) return NULL;
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if(length <= 0 || length > 4096 - 0x200) { fclose(file); return NULL; }
+    chip8_u8* data = (chip8_u8*)malloc(length);
+    if(data == NULL) { fclose(file); return NULL; }
+    *size = (chip8_u16)fread(data, 1, length, file);
+    fclose(file);
+    return data;
+}
+
+// Appends the `frame key down` lines of an input script
+// (see headless.c) to `events`. Prints what went wrong and
+// returns false if the file can not be read, a line does
+// not parse or there are more than `capacity` events.
+static inline int read_script(const char* path, struct script_event* events, size_t capacity, size_t* count)
+{
+    FILE* file = fopen(path, "r");
+    if(file == NULL)
+    {
+        printf("Unable to read the input script %s\n", path);
+        return false;
+    }
+    char line[256];
+    int line_number = 0;
+    while(fgets(line, sizeof(line), file) != NULL)
+    {
+        line_number++;
+        char* start = line;
+        while(*start == ' ' || *start == '\t') start++;
+        if(*start == '#' || *start == '\n' || *start == '\r' || *start == '\0') continue;
+        unsigned long long frame;
+        unsigned int key, pressed;
+        if(sscanf(start, "%llu %x %u", &frame, &key, &pressed) != 3 || key > 15
+            || (*count > 0 && frame < events[*count - 1].frame) || *count == capacity)
+        {
+            printf("%s:%d: expected `frame key down` after the previous event\n", path, line_number);
+            fclose(file);
+            return false;
+        }
+        events[*count].frame = frame;
+        events[*count].key = (chip8_u8)key;
+        events[*count].pressed = pressed != 0;
+        (*count)++;
+    }
+    fclose(file);
+    return true;
+}
+
+#ifdef CHIP8_TOOLS_CORES
+// every core the benchmarks run, the first one is the baseline
+struct bench_core
+{
+    const char* name;
+    chip8_u8 (*run)(struct chip8* vm, const chip8_u8* input, chip8_u32 max_cycles);
+};
+
+#ifdef CHIP8_JIT
+static struct chip8_jit* jit; // created and destroyed by the benchmark around each run
+
+static chip8_u8 run_jit(struct chip8* vm, const chip8_u8* input, chip8_u32 max_cycles)
+{
+    return chip8_run_jit(jit, vm, input, max_cycles);
+}
+#endif
+
+static const struct bench_core cores[] =
+{
+    { "switch", chip8_run_switch },
+    { "predecoded", chip8_run_predecoded },
+    { "threaded", chip8_run_threaded },
+#ifdef CHIP8_JIT
+    { "jit", run_jit },
+#endif
+};
+
+#define CORE_COUNT (sizeof(cores) / sizeof(cores[0]))
+#endif
+
+#endif